@@ -0,0 +1,80 @@
+//
+// Allocations and time per operation of the ring callbacks: InlineFunction against std::function, and a steady
+// stream of reads through AsyncUring.
+//
+
+#include <AsyncUring.h>
+#include <InlineFunction.h>
+#include <ReadStream.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    std::atomic<std::uint64_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    void report(const char* name, std::uint64_t ops, std::uint64_t allocated, Clock::duration elapsed) {
+        std::printf("%-32s %8.1f ns/op %6.2f allocations/op\n", name,
+                    std::chrono::duration<double, std::nano>(elapsed).count() / double(ops),
+                    double(allocated) / double(ops));
+    }
+
+    //Wraps and calls a callback the size of a typical connection lambda, the way the ring did per operation.
+    template<typename Function>
+    void wrapAndCall(const char* name, std::uint64_t ops) {
+        struct { void* self; std::int64_t offset; void* buffer; std::uint64_t length; } captures{};
+        volatile std::int64_t sum = 0;
+        auto before = allocations.load();
+        auto start = Clock::now();
+        for(std::uint64_t i = 0; i < ops; i++) {
+            captures.offset = std::int64_t(i);
+            Function f = [captures, &sum](std::int64_t res){ sum = sum + res + captures.offset; };
+            Function moved = std::move(f);
+            moved(1);
+        }
+        report(name, ops, allocations.load() - before, Clock::now() - start);
+    }
+
+    void ringReads(std::uint64_t ops, unsigned depth) {
+        ftp::bench::ReadStream stream;
+        stream.ring = std::make_unique<ftp::AsyncUring>(256);
+        stream.fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+        if(stream.fd < 0) {
+            std::perror("/dev/zero");
+            return;
+        }
+        stream.buffers.resize(depth);
+        //Fills the operation table before counting.
+        stream.run(depth * 4);
+        auto before = allocations.load();
+        auto start = Clock::now();
+        stream.run(ops);
+        report("AsyncUring read of /dev/zero", ops, allocations.load() - before, Clock::now() - start);
+        close(stream.fd);
+    }
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t ops = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    wrapAndCall<std::function<void(std::int64_t)>>("std::function", ops);
+    wrapAndCall<ftp::Callback>("InlineFunction", ops);
+    ringReads(ops, 32);
+}
@@ -0,0 +1,97 @@
+//
+// Opens and closes of the FileSystemProxy file table from several threads at once, each with a ring of its own,
+// to show how the table scales with the threads. A share of the threads may store new versions meanwhile.
+//
+
+#include <FileSystemProxy.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <thread>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Worker {
+        std::shared_ptr<ftp::AsyncUring> ring = std::make_shared<ftp::AsyncUring>(256);
+        std::shared_ptr<ftp::FileSystemProxy> fileSystem;
+        std::vector<std::filesystem::path> files;
+        std::minstd_rand random;
+        ftp::FileSystemProxy::OpenMode mode = ftp::FileSystemProxy::OpenMode::readonly;
+        std::uint64_t posted = 0, completed = 0, target = 0;
+        ftp::Dispatcher dispatch = [](ftp::Completion&& completion){ completion(); };
+
+        void post() {
+            posted++;
+            fileSystem->open(ring, files[random() % files.size()], mode, [this](int fd){
+                if(fd < 0) {
+                    done();
+                    return;
+                }
+                fileSystem->close(ring, fd, [this]{ done(); });
+            });
+        }
+
+        void done() {
+            completed++;
+            if(posted < target)
+                post();
+        }
+
+        void run(std::uint64_t ops, unsigned depth) {
+            target = ops;
+            for(unsigned i = 0; i < depth; i++)
+                post();
+            while(completed < target)
+                ring->wait_act(std::chrono::milliseconds(100), dispatch);
+        }
+    };
+
+    double openCloses(const std::shared_ptr<ftp::FileSystemProxy>& fileSystem,
+                      const std::vector<std::filesystem::path>& files, unsigned threads, unsigned writers,
+                      std::uint64_t ops) {
+        std::vector<std::unique_ptr<Worker>> workers;
+        for(unsigned i = 0; i < threads; i++) {
+            auto& worker = *workers.emplace_back(std::make_unique<Worker>());
+            worker.fileSystem = fileSystem;
+            worker.files = files;
+            worker.random.seed(i + 1);
+            if(i < writers)
+                worker.mode = ftp::FileSystemProxy::OpenMode::writeonly;
+        }
+        auto start = Clock::now();
+        {
+            std::vector<std::jthread> running;
+            for(auto& worker: workers)
+                running.emplace_back([&worker, ops]{ worker->run(ops, 16); });
+        }
+        return double(ops * threads) / std::chrono::duration<double>(Clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t ops = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    unsigned fileCount = argc > 2 ? unsigned(std::strtoul(argv[2], nullptr, 10)) : 1000;
+    auto root = std::filesystem::temp_directory_path() / ("ftp-file-table-bench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    std::vector<std::filesystem::path> files;
+    for(unsigned i = 0; i < fileCount; i++) {
+        files.emplace_back("file" + std::to_string(i));
+        std::ofstream(root / files.back()) << i;
+    }
+    {
+        auto fileSystem = std::make_shared<ftp::FileSystemProxy>(root);
+        std::printf("%-8s %-8s %14s\n", "threads", "writers", "opens/s");
+        for(unsigned threads = 1; threads <= std::max(1U, std::thread::hardware_concurrency()); threads *= 2) {
+            std::printf("%-8u %-8u %14.0f\n", threads, 0U, openCloses(fileSystem, files, threads, 0, ops));
+            //RETR opens should not slow down behind the STOR commits of unrelated files.
+            if(unsigned writers = threads / 4)
+                std::printf("%-8u %-8u %14.0f\n", threads, writers,
+                            openCloses(fileSystem, files, threads, writers, ops));
+        }
+    }
+    std::filesystem::remove_all(root);
+}
@@ -0,0 +1,37 @@
+#ifndef URING_TCP_SERVER_READSTREAM_H
+#define URING_TCP_SERVER_READSTREAM_H
+
+#include <AsyncUring.h>
+
+namespace ftp::bench {
+
+    //Keeps a read of /dev/zero in flight per buffer, each completion posting the next one until target reads are posted.
+    struct ReadStream {
+        std::unique_ptr<AsyncUring> ring;
+        int fd = -1;
+        std::vector<std::array<std::byte, 512>> buffers;
+        std::uint64_t posted = 0, completed = 0, target = 0;
+        Dispatcher dispatch = [](Completion&& completion){ completion(); };
+
+        void post(std::size_t slot) {
+            posted++;
+            ring->async_read_some(fd, buffers[slot], nullptr, [this, slot](std::int64_t){
+                completed++;
+                if(posted < target)
+                    post(slot);
+            });
+        }
+
+        //Runs until the given number of reads more has completed.
+        void run(std::uint64_t reads) {
+            target += reads;
+            for(std::size_t slot = 0; slot < buffers.size(); slot++)
+                post(slot);
+            while(completed < target)
+                ring->wait_act(std::chrono::milliseconds(100), dispatch);
+        }
+    };
+
+}
+
+#endif //URING_TCP_SERVER_READSTREAM_H
@@ -0,0 +1,73 @@
+//
+// The same stream of reads through rings set up in each of the AsyncUring configurations, to compare what the setup
+// flags the kernel accepts (SINGLE_ISSUER, DEFER_TASKRUN, COOP_TASKRUN) buy.
+// Also floods a small SQ from a thread other than the loop, which the single issuer rings cannot submit from.
+//
+
+#include <AsyncUring.h>
+#include <ReadStream.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    void measure(const char* name, int fd, std::uint64_t ops, unsigned depth, unsigned submitBatch,
+                 bool singleIssuer) {
+        ftp::bench::ReadStream stream;
+        stream.ring = std::make_unique<ftp::AsyncUring>(256, ftp::AsyncUring::UringMode::interrupted, submitBatch,
+                                                        ftp::AsyncUring::defaultSubmitBytes, ftp::SqThread{},
+                                                        singleIssuer);
+        stream.fd = fd;
+        stream.buffers.resize(depth);
+        stream.run(depth * 4);
+        auto start = Clock::now();
+        stream.run(ops);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::printf("%-28s %-44s %12.0f ops/s\n", name, stream.ring->setup_description().c_str(),
+                    double(ops) / seconds);
+    }
+
+    //Reads posted by a thread other than the loop, in a single burst far deeper than the SQ. The ring holds back
+    //what does not fit until the loop makes room, so all of them complete and none of the posts fails.
+    void foreignBurst(const char* name, int fd, std::uint64_t ops, bool singleIssuer) {
+        ftp::AsyncUring ring(8, ftp::AsyncUring::UringMode::interrupted, 1, ftp::AsyncUring::defaultSubmitBytes,
+                             ftp::SqThread{}, singleIssuer);
+        std::array<std::byte, 512> buffer{};
+        std::atomic<std::uint64_t> completed{0};
+        ftp::Dispatcher dispatch = [](ftp::Completion&& completion){ completion(); };
+        auto start = Clock::now();
+        std::jthread poster([&]{
+            for(std::uint64_t i = 0; i < ops; i++)
+                ring.async_read_some(fd, buffer, nullptr, [&completed](std::int64_t){ completed++; });
+        });
+        while(completed < ops)
+            ring.wait_act(std::chrono::milliseconds(100), dispatch);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::printf("%-28s %-44s %12.0f ops/s\n", name, ring.setup_description().c_str(), double(ops) / seconds);
+    }
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t ops = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    int fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        std::perror("/dev/zero");
+        return 1;
+    }
+    for(unsigned batch: {1U, 16U}) {
+        std::printf("submit batch %u\n", batch);
+        measure("shared", fd, ops, 32, batch, false);
+        measure("single issuer", fd, ops, 32, batch, true);
+    }
+    std::printf("burst of another thread into an SQ of 8\n");
+    foreignBurst("shared", fd, std::min<std::uint64_t>(ops, 100000), false);
+    foreignBurst("single issuer", fd, std::min<std::uint64_t>(ops, 100000), true);
+    close(fd);
+}
@@ -7,16 +7,50 @@
 #include <system_error>
 #include <utility>
 #include <span>
+#include <array>
 #include <functional>
 #include <memory>
 #include <arpa/inet.h>
-#include <boost/intrusive/list.hpp>
+#include <BufferPool.h>
+#include <InlineFunction.h>
 #include <mutex>
+#include <condition_variable>
+#include <cassert>
+#include <chrono>
+#include <bitset>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <variant>
+#include <coroutine>
+#include <filesystem>
+#include <thread>
 
 namespace ftp{
 
-    using Callback = std::function<void(std::int64_t)>;
+    //Move-only: the ring stores the callback of an operation in place, no matter whether it gets a lambda or a copy
+    //of a std::function.
+    using Callback = InlineFunction<void(std::int64_t)>;
     using Predicate = std::function<std::ptrdiff_t(const std::string&)>;
+    //Receives the results of both halves of a linked pair: the one feeding the intermediate and the one draining it.
+    using LinkedCallback = InlineFunction<void(std::int64_t, std::int64_t)>;
+    //A callback bound to its result, big enough to carry either kind of callback along with the results.
+    using Completion = InlineFunction<void(), 96>;
+    using Dispatcher = std::function<void(Completion&&)>;
+
+    //Collects the bytes delivered by a multishot recv in the order of their arrival.
+    struct RecvQueue {
+        std::mutex mutex;
+        std::string data;
+    };
+
+    //Placement of the kernel thread polling the SQ of a sq_polled AsyncUring.
+    struct SqThread {
+        //CPU the thread is bound to (IORING_SETUP_SQ_AFF), -1 to leave it to the scheduler.
+        int cpu = -1;
+        //How long the thread keeps polling an empty SQ before it goes to sleep, 0 for the kernel default.
+        std::chrono::milliseconds idle{0};
+    };
 
     class AsyncUring{
     public:
@@ -25,7 +59,27 @@ namespace ftp{
             io_polled = IORING_SETUP_IOPOLL,
             sq_polled = IORING_SETUP_SQPOLL
         };
-        explicit AsyncUring(int size, UringMode mode = UringMode::interrupted){
+        static constexpr std::size_t defaultSubmitBytes = 1UL << 20;
+        /**
+         * @param size - SQ depth, must be a power of two up to 4096
+         * @param submitBatch - the number of SQEs to queue before they are submitted to the kernel. A value of 1 submits
+         * every operation immediately, greater values make the ring wait for flush() or for the threshold to be hit.
+         * The operations posted by the threads other than the one in wait_act() wake it up to flush them.
+         * @param submitBytes - the amount of queued read/write payload (in bytes) that forces a submission regardless
+         * of the SQE count, so bulk transfers are not delayed behind the batch.
+         * @param sqThread - ignored unless mode is sq_polled
+         * @param singleIssuer - the ring is waited on by a single thread, the first one to call wait_act(). Lets
+         * the kernel skip the locking of the submissions (IORING_SETUP_SINGLE_ISSUER) and defer the completion work
+         * until that thread waits (IORING_SETUP_DEFER_TASKRUN). The other threads may still post operations, the
+         * ring leaves them for the waiting thread to submit and wakes it up.
+         * Whatever the kernel does not support is dropped, see setup_description() for the outcome.
+         */
+        explicit AsyncUring(int size, UringMode mode = UringMode::interrupted, unsigned submitBatch = 1,
+                            std::size_t submitBytes = defaultSubmitBytes, SqThread sqThread = {},
+                            bool singleIssuer = false):
+                _polled(mode == UringMode::io_polled),
+                _submitBatch(submitBatch),
+                _submitBytes(submitBytes){
             assert(
                     size == 1UL ||
                     size == 1UL << 1 ||
@@ -41,42 +95,347 @@ namespace ftp{
                     size == 1UL << 11 ||
                     size == 1UL << 12
             );
-            int res = io_uring_queue_init(size, &ring, int(mode));
+            assert(submitBatch > 0 && submitBatch <= unsigned(size));
+            int res = init_ring(unsigned(size), mode, sqThread, singleIssuer);
             if(res < 0) {
-                throw std::system_error(errno, std::system_category(), "AsyncUring()");
+                throw std::system_error(-res, std::system_category(), "AsyncUring()");
+            }
+            if(auto probe = io_uring_get_probe_ring(&ring)) {
+                for(int op = 0; op < int(_supportedOps.size()); op++)
+                    _supportedOps[op] = io_uring_opcode_supported(probe, op);
+                io_uring_free_probe(probe);
             }
         }
 
-        void async_read_some(int fd, std::shared_ptr<std::string>&& data, Callback cb, int offset = 0);
-        void async_read_some(int fd, std::span<std::byte> data, std::shared_ptr<std::string>&& dataToKeep, Callback cb, int offset = 0);
-        void async_write_some(int fd, std::shared_ptr<std::string>&& data, Callback cb, int offset = 0);
-        void async_write_some(int fd, std::span<const std::byte> data, std::shared_ptr<std::string>&& dataToKeep, Callback cb, int offset = 0);
-        void async_read(int fd, std::shared_ptr<std::string>&& data, std::size_t len, Callback cb, int offset = 0);
-        void async_write(int fd, std::shared_ptr<std::string>&& data, std::size_t len, Callback cb, int offset = 0);
-        void async_read_until(int fd, std::shared_ptr<std::string>&& data, const std::string& delim, Callback cb, int offset = 0);
-        void async_read_until(int fd, std::shared_ptr<std::string>&& data, Predicate pred, Callback cb, int offset = 0);
+        //Tells whether the running kernel implements the given IORING_OP_* opcode.
+        [[nodiscard]] bool supports(int opcode) const noexcept {
+            return opcode >= 0 && opcode < int(_supportedOps.size()) && _supportedOps[opcode];
+        }
+
+        //The IORING_SETUP_* flags the ring has been created with.
+        [[nodiscard]] unsigned setup_flags() const noexcept { return _setupFlags; }
+        //The setup flags in words, e.g. "single issuer, deferred task work".
+        [[nodiscard]] std::string setup_description() const;
+
+        //The probe does not report the accept flags, but multishot accept came in 5.19 along with IORING_OP_SOCKET.
+        [[nodiscard]] bool supports_multishot_accept() const noexcept { return supports(IORING_OP_SOCKET); }
+
+        void async_read_some(int fd, std::shared_ptr<std::string>&& data, Callback cb, std::uint64_t offset = 0);
+        void async_read_some(int fd, std::span<std::byte> data, std::shared_ptr<std::string>&& dataToKeep, Callback cb, std::uint64_t offset = 0);
+        void async_write_some(int fd, std::shared_ptr<std::string>&& data, Callback cb, std::uint64_t offset = 0);
+        void async_write_some(int fd, std::span<const std::byte> data, std::shared_ptr<std::string>&& dataToKeep, Callback cb, std::uint64_t offset = 0);
+        /**
+         * async_send_zc - sends the buffer without copying it into the socket buffers (IORING_OP_SEND_ZC).
+         * The kernel posts the result first and notifies separately once it is done with the pages: cb gets called
+         * on the result, while dataToKeep stays referenced until the notification arrives.
+         */
+        void async_send_zc(int fd, std::shared_ptr<std::string>&& data, Callback cb);
+        void async_send_zc(int fd, std::span<const std::byte> data, std::shared_ptr<std::string>&& dataToKeep, Callback cb);
+        //READ_FIXED/WRITE_FIXED on a buffer of the registered pool. data has to lie within the buffer.
+        void async_read_fixed(int fd, std::span<std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer, Callback cb, std::uint64_t offset = 0);
+        void async_write_fixed(int fd, std::span<const std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer, Callback cb, std::uint64_t offset = 0);
+        /**
+         * async_read_write_fixed - reads into the registered buffer and writes whatever was read on, submitted at once
+         * as a linked chain (IOSQE_IO_LINK), so the data makes a round without a trip through the user space.
+         * A soft link is used on purpose: a short read has to stop the write, which would otherwise send stale bytes.
+         * @param fromSocket - the source is a socket, read it with MSG_WAITALL so that only EOF ends the read short
+         * @param cb - receives the read and the write results. A short read breaks the link: the write then reports
+         * -ECANCELED and the bytes read are left in the buffer for the caller to write. Where the kernel allows it,
+         * a successful read posts no CQE, so a round costs a single completion.
+         */
+        void async_read_write_fixed(int fdIn, std::uint64_t inOffset, int fdOut, std::uint64_t outOffset,
+                                    std::span<std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer,
+                                    LinkedCallback cb, bool fromSocket = false);
+        void async_read(int fd, std::shared_ptr<std::string>&& data, std::size_t len, Callback cb, std::uint64_t offset = 0);
+        void async_write(int fd, std::shared_ptr<std::string>&& data, std::size_t len, Callback cb, std::uint64_t offset = 0);
+        void async_read_until(int fd, std::shared_ptr<std::string>&& data, const std::string& delim, Callback cb, std::uint64_t offset = 0);
+        void async_read_until(int fd, std::shared_ptr<std::string>&& data, Predicate pred, Callback cb, std::uint64_t offset = 0);
         void async_sock_accept(int fd, sockaddr* addr, socklen_t* len, int flags, Callback cb);
+        /**
+         * async_sock_accept_multishot - keeps accepting on the listening socket with a single SQE: cb gets every
+         * accepted fd as it lands. Re-armed transparently, so cb(res < 0) is the last call.
+         */
+        void async_sock_accept_multishot(int fd, Callback cb);
         void async_sock_connect(int fd, sockaddr* addr, socklen_t len, Callback cb);
-        std::function<void()> check_act();
+        //Fills buf with the metadata of path (relative to dirfd) by IORING_OP_STATX. path and buf have to stay
+        //valid until cb is called.
+        void async_statx(int dirfd, const char* path, int flags, unsigned mask, struct statx* buf, Callback cb);
+        /**
+         * Filesystem operations, kept off the calling thread so that a slow filesystem only delays the session
+         * waiting for it. The ring keeps the paths (and the statx buffer) until cb is called. cb gets the result
+         * of the system call, i.e. the descriptor or -errno. On a kernel that lacks the opcode the system call is
+         * made in place and cb is called before returning.
+         */
+        void async_statx(int dirfd, std::filesystem::path path, int flags, unsigned mask,
+                         std::shared_ptr<struct statx> buf, Callback cb);
+        void async_openat(int dirfd, std::filesystem::path path, int flags, mode_t mode, Callback cb);
+        //fd has to be unregistered from the fixed file table beforehand.
+        void async_close(int fd, Callback cb);
+        void async_unlinkat(int dirfd, std::filesystem::path path, int flags, Callback cb);
+        void async_mkdirat(int dirfd, std::filesystem::path path, mode_t mode, Callback cb);
+        //Calls cb(0) from the completion of an IORING_OP_NOP, i.e. on whichever thread reaps this ring. Hands the
+        //result of work done on another thread back to the sessions of the ring.
+        void async_nop(Callback cb);
+        /**
+         * async_recv_multishot - keeps receiving from the socket into the provided buffer ring, so no memory is tied
+         * to the socket while it is idle. The arrived bytes are appended to queue by the reaping thread in the order
+         * of arrival and the buffer is handed back to the ring right away; cb then gets the amount appended.
+         * The receive is re-armed transparently whenever the kernel ends it, so cb(res <= 0) - EOF or an error -
+         * is the last call.
+         * Requires register_provided_buffers().
+         */
+        void async_recv_multishot(int fd, std::shared_ptr<RecvQueue> queue, Callback cb);
+        //Offsets of -1 make the splice use (and advance) the current position, as required for pipes and sockets.
+        void async_splice(int fdIn, std::int64_t offIn, int fdOut, std::int64_t offOut, std::size_t len, Callback cb);
+        /**
+         * async_splice_through - moves up to len bytes from fdIn to fdOut through a pipe without copying them to
+         * the user space. Both splices are submitted at once as a linked chain.
+         * @param pipe - {read end, write end} of a pipe, which is expected to be empty
+         * @param cb - receives the number of bytes put into the pipe and the number of bytes taken out of it. A short
+         * first splice (including EOF) breaks the link, so the second result is -ECANCELED and the data that made it
+         * into the pipe is left there for the caller to drain.
+         */
+        void async_splice_through(int fdIn, std::int64_t offIn, const std::array<int, 2>& pipe, int fdOut,
+                                  std::size_t len, LinkedCallback cb);
+
+        /**
+         * awaitable - co_await-able form of an operation, for the coroutines (see Task.h). The submission happens on
+         * co_await and the coroutine is resumed by the thread running the completion, with Result as the value of
+         * the co_await expression. The buffers are the coroutine's to keep alive until then.
+         */
+        template<typename Result, typename Submit>
+        class awaitable {
+        public:
+            explicit awaitable(Submit&& submit): _submit(std::move(submit)) {}
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                if constexpr (std::is_same_v<Result, std::int64_t>)
+                    _submit(Callback([this, handle](std::int64_t res){
+                        _result = res;
+                        handle.resume();
+                    }));
+                else
+                    _submit(LinkedCallback([this, handle](std::int64_t first, std::int64_t second){
+                        _result = {first, second};
+                        handle.resume();
+                    }));
+            }
+
+            Result await_resume() const noexcept { return _result; }
+
+        private:
+            Submit _submit;
+            Result _result{};
+        };
+
+        auto read(int fd, std::span<std::byte> data, std::uint64_t offset = 0) {
+            return make_awaitable<std::int64_t>([=, this](Callback&& cb){
+                async_read_some(fd, data, std::shared_ptr<std::string>(), std::move(cb), offset);
+            });
+        }
+        auto write(int fd, std::span<const std::byte> data, std::uint64_t offset = 0) {
+            return make_awaitable<std::int64_t>([=, this](Callback&& cb){
+                async_write_some(fd, data, std::shared_ptr<std::string>(), std::move(cb), offset);
+            });
+        }
+        auto accept(int fd, sockaddr* addr = nullptr, socklen_t* len = nullptr, int flags = 0) {
+            return make_awaitable<std::int64_t>([=, this](Callback&& cb){
+                async_sock_accept(fd, addr, len, flags, std::move(cb));
+            });
+        }
+        auto splice(int fdIn, std::int64_t offIn, int fdOut, std::int64_t offOut, std::size_t len) {
+            return make_awaitable<std::int64_t>([=, this](Callback&& cb){
+                async_splice(fdIn, offIn, fdOut, offOut, len, std::move(cb));
+            });
+        }
+        //Yields the results of both splices, as passed to the callback of async_splice_through().
+        auto splice_through(int fdIn, std::int64_t offIn, const std::array<int, 2>& pipe, int fdOut, std::size_t len) {
+            return make_awaitable<std::pair<std::int64_t, std::int64_t>>([=, this](LinkedCallback&& cb){
+                async_splice_through(fdIn, offIn, pipe, fdOut, len, std::move(cb));
+            });
+        }
+        /**
+         * wait_act - one turn of the completion loop. Flushes the queued SQEs, blocks for up to timeout until
+         * a completion arrives and then reaps every ready completion in batches. An io_polled ring busy-polls the
+         * device while it has operations in flight and sleeps until the next one is posted otherwise.
+         * @param dispatch - receives each callback bound to its result. It is called without the ring locked,
+         * so it may run the callback inline as well as hand it over to an executor.
+         * @return the number of completions reaped
+         */
+        std::size_t wait_act(std::chrono::milliseconds timeout, const Dispatcher& dispatch);
+
+        //Submits all the queued SQEs to the kernel. Returns the number of SQEs submitted.
+        int flush();
+
+        /**
+         * register_buffer_pool - registers the pool buffers with the ring, making them available to the *_fixed
+         * operations. Only one pool may be registered per ring.
+         * @return false if the kernel refused the registration (e.g. RLIMIT_MEMLOCK is too low)
+         */
+        bool register_buffer_pool(std::shared_ptr<BufferPool> pool);
+        //The registered pool, or nullptr if there is none.
+        [[nodiscard]] const std::shared_ptr<BufferPool>& buffer_pool() const noexcept { return _bufferPool; }
+
+        /**
+         * attach_file_ring - pairs the ring with an io_polled ring for the O_DIRECT file reads of the large-file
+         * mode, which keeps them apart from the socket operations IOPOLL cannot serve. The file ring is expected to
+         * have the same buffer pool registered, so the *_fixed reads may use the buffers of either.
+         */
+        void attach_file_ring(std::shared_ptr<AsyncUring> fileRing) { _fileRing = std::move(fileRing); }
+        //The attached file ring, or nullptr if the large-file mode is off.
+        [[nodiscard]] const std::shared_ptr<AsyncUring>& file_ring() const noexcept { return _fileRing; }
+
+        /**
+         * register_provided_buffers - sets up a ring of count buffers of size bytes, which the kernel picks from
+         * for the multishot receives (IORING_REGISTER_PBUF_RING).
+         * @return false if the kernel does not support the provided buffer rings
+         */
+        bool register_provided_buffers(unsigned count, std::size_t size);
+        [[nodiscard]] bool has_provided_buffers() const noexcept { return _providedBuffers.ring != nullptr; }
+
+        /**
+         * enable_fixed_files - registers a sparse table of size descriptors with the ring. The descriptors mapped
+         * into it by register_file() are then posted as fixed files (IOSQE_FIXED_FILE), sparing the kernel
+         * the fget/fput pair on every operation.
+         * @return false if the kernel refused the table
+         */
+        bool enable_fixed_files(unsigned size);
+        //Maps fd into a free slot of the fixed table. Returns false if there is no table or no free slot left.
+        bool register_file(int fd);
+        //Drops fd from the fixed table. Has to be called before fd is closed, as the number may be reused.
+        void unregister_file(int fd);
+
+        [[nodiscard]] bool batching() const noexcept { return _submitBatch > 1; }
 
         ~AsyncUring(){
+            if(_wakeFd >= 0)
+                close(_wakeFd);
+            if(_providedBuffers.ring)
+                io_uring_free_buf_ring(&ring, _providedBuffers.ring, _providedBuffers.count, providedBufferGroup);
             io_uring_queue_exit(&ring);
-            active_callbacks.clear_and_dispose(std::default_delete<intrusive_callback>());
         }
 
     private:
+        template<typename Result, typename Submit>
+        static awaitable<Result, Submit> make_awaitable(Submit&& submit) {
+            return awaitable<Result, Submit>(std::move(submit));
+        }
+
+        //The number of CQEs taken from the CQ at once by wait_act().
+        static constexpr unsigned reapBatch = 64;
+        //user_data of the poll on _wakeFd, out of the range of the operation indices and of liburing's own timeouts.
+        static constexpr std::uint64_t wakeEvent = UINT64_MAX - 1;
+        //Buffer group id of the provided buffer ring.
+        static constexpr int providedBufferGroup = 0;
+
         io_uring ring{};
+        std::bitset<256> _supportedOps;
         std::mutex _taskPostMutex;
+        bool _polled;
+        unsigned _setupFlags = 0;
+        //Single issuer and batching rings only: the thread running wait_act(), none until its first call, and the
+        //eventfd the other threads wake it up with when they have left SQEs for it. _wakePending is set meanwhile.
+        //Of a single issuer ring, the loop thread is the only one allowed to enter it.
+        std::thread::id _loopThread;
+        int _wakeFd = -1;
+        bool _wakePending = false;
+        //SQEs prepared while the SQ was full and the calling thread could not submit it, in the order of posting.
+        //Moved into the SQ by the next submission of the loop thread. _overflowNext forces the SQEs of a chain
+        //that does not fit as a whole in there as well.
+        std::deque<io_uring_sqe> _overflow;
+        unsigned _overflowNext = 0;
+        //Operations posted and not yet completed. Only tracked to let an idle io_polled ring sleep.
+        std::size_t _inFlight = 0;
+        std::condition_variable _operationPosted;
+        std::shared_ptr<AsyncUring> _fileRing;
+        unsigned _submitBatch;
+        std::size_t _submitBytes;
+        std::size_t _pendingBytes = 0;
+        std::shared_ptr<BufferPool> _bufferPool;
+        //Slot of every registered fd in the fixed file table (indexed by fd, -1 if not registered) and the free slots.
+        std::vector<int> _fixedSlots;
+        std::vector<unsigned> _freeFixedSlots;
+        struct {
+            io_uring_buf_ring* ring = nullptr;
+            std::unique_ptr<std::byte[]> memory;
+            unsigned count = 0;
+            std::size_t size = 0;
+        } _providedBuffers;
+
+        static constexpr std::uint32_t noOperation = UINT32_MAX;
+        //Operations are allocated in chunks of this size, which never move once allocated.
+        static constexpr std::uint32_t operationChunk = 256;
+
+        //An operation in flight. Its index in the operation table is the user_data of its SQE.
+        struct operation {
+            //To avoid memory leak, we have to ensure that the data we interact with is still present.
+            std::shared_ptr<void> i_data_;
+            //Multishot operations share their callback with the completions of every delivery. Of a linked pair,
+            //the tail holds the pair's callback and the head holds none.
+            std::variant<std::monostate, Callback, LinkedCallback, std::shared_ptr<Callback>> cb_;
+            //Multishot operations stay registered across completions and get re-armed on fd_ when the kernel
+            //ends them early. The receives keep their RecvQueue in i_data_.
+            enum class multishot: char { none, recv, accept } multishot_ = multishot::none;
+            //CQEs the linked pair still waits for (tail only).
+            std::uint8_t pending_ = 0;
+            int fd_ = -1;
+            //The other half of a linked pair.
+            std::uint32_t linked_ = noOperation;
+            //Next free operation while the operation is unused.
+            std::uint32_t nextFree_ = noOperation;
+            //Results of the pair's halves collected so far (tail only).
+            std::array<std::int64_t, 2> results_{};
+        };
+
+        //Freed operations are reused, so the table only allocates while it grows to the peak number in flight.
+        std::vector<std::unique_ptr<operation[]>> _operations;
+        std::uint32_t _freeOperations = noOperation;
+
+        //Creates the ring with the most of the task work flags the kernel accepts. Returns 0 or -errno.
+        int init_ring(unsigned size, UringMode mode, SqThread sqThread, bool singleIssuer);
+        //Makes the calling thread the loop thread, enabling a single issuer ring for it.
+        void adopt_loop_thread();
+        //Polls _wakeFd once more. Expects _taskPostMutex to be held by the loop thread.
+        void arm_wake();
+        //Wakes the loop thread up to submit the queued SQEs. Expects _taskPostMutex to be held.
+        void wake_loop();
+        //Whether the calling thread has to leave the submission to the issuer.
+        [[nodiscard]] bool foreign_thread() const noexcept {
+            return (_setupFlags & IORING_SETUP_SINGLE_ISSUER) && _loopThread != std::this_thread::get_id();
+        }
 
-        class intrusive_callback: public boost::intrusive::list_base_hook<> {
-            public:
-                explicit intrusive_callback(Callback cb, std::shared_ptr<std::string>&& i_data): cb_(std::move(cb)), i_data_(i_data){}
-                //To avoid memory leak, we have to ensure that the data we interact with is still present.
-                std::shared_ptr<std::string> i_data_;
-                Callback cb_;
-            };
+        operation& op(std::uint32_t index) noexcept { return _operations[index / operationChunk][index % operationChunk]; }
+        std::uint32_t acquire_operation();
+        void release_operation(std::uint32_t index);
 
-        boost::intrusive::list<intrusive_callback> active_callbacks;
+        //Every post_* helper expects _taskPostMutex to be held by the caller.
+        //Never fails: an SQE the SQ has no room for is prepared in _overflow instead.
+        io_uring_sqe* acquire_sqe();
+        //Makes sure the next count SQEs can be taken without a submission in between, as required by linked chains.
+        void reserve_sqes(unsigned count);
+        //Moves the SQEs of _overflow into the SQ, whole chains at a time, as long as they fit. Returns whether any has.
+        bool move_overflow();
+        //linkNext postpones the threshold submission until the rest of the chain is queued. Returns the operation.
+        std::uint32_t enqueue(io_uring_sqe* task, Callback&& cb, std::shared_ptr<void>&& dataToKeep,
+                              std::size_t payload, bool linkNext = false);
+        /**
+         * Links two prepared SQEs into a pair reporting to a single callback. Where the kernel allows it, a complete
+         * head posts no CQE, so the pair costs a single completion.
+         * @param headLength - the head's result if it completes in full
+         */
+        void enqueue_pair(io_uring_sqe* head, io_uring_sqe* tail, LinkedCallback&& cb,
+                          std::shared_ptr<void>&& dataToKeep, std::int64_t headLength, std::size_t payload);
+        int submit_pending();
+        //Switches the descriptors of a prepared SQE to their fixed table slots, if they have one.
+        void apply_fixed_files(io_uring_sqe* task);
+        void prep_recv_multishot(io_uring_sqe* task, int fd);
+        void arm_multishot(operation::multishot kind, int fd, Callback&& cb, std::shared_ptr<void>&& dataToKeep);
+        //Hands a provided buffer back to the kernel.
+        void recycle_provided(unsigned short bufferId);
+        //Settles a single CQE with _taskPostMutex held and returns the callback bound to its result, if any.
+        Completion complete(std::uint32_t index, const io_uring_cqe* cqe);
     };
 
 }
@@ -0,0 +1,71 @@
+#ifndef URING_TCP_SERVER_BUFFERPOOL_H
+#define URING_TCP_SERVER_BUFFERPOOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include <sys/uio.h>
+
+namespace ftp {
+
+    /**
+     * BufferPool - a fixed budget of page-aligned buffers, allocated once and meant to be registered with a ring
+     * (io_uring_register_buffers), so that the transfers may use READ_FIXED/WRITE_FIXED on them.
+     * The buffers are lent out as shared pointers which return the buffer to the pool when the last owner drops it.
+     */
+    class BufferPool: public std::enable_shared_from_this<BufferPool> {
+    public:
+        class Buffer {
+        public:
+            Buffer(std::shared_ptr<BufferPool> pool, int index): _pool(std::move(pool)), _index(index) {}
+
+            Buffer(const Buffer&) = delete;
+            Buffer& operator=(const Buffer&) = delete;
+
+            //Index of the buffer in the registered table, as expected by the *_fixed operations.
+            [[nodiscard]] int index() const noexcept { return _index; }
+            [[nodiscard]] std::span<std::byte> data() const noexcept {
+                return {static_cast<std::byte*>(_pool->_iovecs[_index].iov_base), _pool->_iovecs[_index].iov_len};
+            }
+
+            ~Buffer() { _pool->release(_index); }
+
+        private:
+            std::shared_ptr<BufferPool> _pool;
+            int _index;
+        };
+
+        //Allocates count buffers of bufferSize bytes (rounded up to whole pages).
+        static std::shared_ptr<BufferPool> create(std::size_t count, std::size_t bufferSize) {
+            return std::shared_ptr<BufferPool>(new BufferPool(count, bufferSize));
+        }
+
+        //Lends a free buffer or returns nullptr if the whole budget is in use.
+        std::shared_ptr<Buffer> acquire();
+
+        [[nodiscard]] const std::vector<iovec>& iovecs() const noexcept { return _iovecs; }
+        [[nodiscard]] std::size_t bufferSize() const noexcept { return _bufferSize; }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        ~BufferPool();
+
+    private:
+        BufferPool(std::size_t count, std::size_t bufferSize);
+
+        void release(int index);
+
+        std::byte* _memory;
+        std::size_t _bufferSize;
+        std::size_t _mappedSize;
+        std::vector<iovec> _iovecs;
+        std::vector<int> _freeBuffers;
+        std::mutex _poolMutex;
+    };
+
+}
+
+#endif //URING_TCP_SERVER_BUFFERPOOL_H
@@ -7,10 +7,11 @@
 #include <iostream>
 #include <FileSystemProxy.h>
 #include <AsyncUring.h>
+#include <Task.h>
 
 namespace ftp {
 
-    class ConnectionBase{
+    class ConnectionBase: public std::enable_shared_from_this<ConnectionBase> {
     public:
 
         ConnectionBase(int fd,
@@ -31,6 +32,15 @@ namespace ftp {
                 _localAddr(parent->_localAddr),
                 _ring(parent->_ring) {}
 
+        ConnectionBase(ConnectionBase* parent,
+                       std::shared_ptr<AsyncUring>&& ring
+                          ):
+                _fd(parent->_fd),
+                _childConnectionsMutex(),
+                _parent(parent),
+                _localAddr(parent->_localAddr),
+                _ring(ring) {}
+
         virtual void start();
 
         sockaddr_in localAddr() const noexcept {
@@ -46,6 +56,17 @@ namespace ftp {
 
         void enqueueConnection(int fd, std::shared_ptr<ConnectionBase>&& connection);
 
+        //Takes an already accepted socket as a child connection and starts it right away.
+        void adoptConnection(int fd, std::shared_ptr<ConnectionBase>&& connection);
+
+        //Frames of the connection's coroutines. Created with the first one, which the connection only ever starts from
+        //the thread it is being served by.
+        const std::shared_ptr<FramePool>& framePool() {
+            if(!_framePool)
+                _framePool = std::make_shared<FramePool>();
+            return _framePool;
+        }
+
         virtual ~ConnectionBase(){
             ConnectionBase::stop();
         }
@@ -58,9 +79,13 @@ namespace ftp {
         std::mutex _childConnectionsMutex;
         ConnectionBase* _parent;
         std::shared_ptr<AsyncUring> _ring;
+        std::shared_ptr<FramePool> _framePool;
 
         virtual void startActing() = 0;
 
+        //Notifies the parent that a child enqueued with enqueueConnection() has got its connection.
+        virtual void childAccepted([[maybe_unused]] ConnectionBase* child) {}
+
         //To keep the children list up to date, we need to find and erase the closed child from the children list
         void acceptChildStop(ConnectionBase* child);
 
@@ -26,8 +26,13 @@ namespace ftp {
         void mode(const std::string& modeCode) final;
         void retr(std::filesystem::path path) final;
         void stor(std::filesystem::path path) final;
+        void rest(const std::string& marker) final;
         void pwd() const final;
         void list(std::filesystem::path path) const final;
+        void mlsd(std::filesystem::path path) const final;
+        void mlst(std::filesystem::path path) const final;
+        void size(std::filesystem::path path) const final;
+        void mdtm(std::filesystem::path path) const final;
     };
 
     class ControlConnectionStateNotLoggedIn: public ControlConnectionState{
@@ -44,8 +49,13 @@ namespace ftp {
         void mode(const std::string& modeCode) final { defaultBehavior(); }
         void retr(std::filesystem::path path) final { defaultBehavior(); }
         void stor(std::filesystem::path path) final { defaultBehavior(); }
+        void rest(const std::string& marker) final { defaultBehavior(); }
         void pwd() const final { defaultBehavior(); }
         void list(std::filesystem::path path) const final { defaultBehavior(); }
+        void mlsd(std::filesystem::path path) const final { defaultBehavior(); }
+        void mlst(std::filesystem::path path) const final { defaultBehavior(); }
+        void size(std::filesystem::path path) const final { defaultBehavior(); }
+        void mdtm(std::filesystem::path path) const final { defaultBehavior(); }
 
         void defaultBehavior() const {
             _handledConnection->ring()->async_write(
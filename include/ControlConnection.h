@@ -7,7 +7,11 @@
 #include <arpa/inet.h>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
 #include <Common.h>
+#include <LineEndings.h>
+#include <DirectoryLister.h>
+#include <ListingCache.h>
 
 namespace ftp {
 
@@ -31,9 +35,16 @@ namespace ftp {
         virtual void mode(const std::string& modeCode) = 0;
         virtual void retr(std::filesystem::path path) = 0;
         virtual void stor(std::filesystem::path path) = 0;
+        virtual void rest(const std::string& marker) = 0;
         virtual void pwd() const = 0;
         virtual void list(std::filesystem::path path) const = 0;
+        //RFC 3659 extensions, answered from the metadata kept by FileSystemProxy.
+        virtual void mlsd(std::filesystem::path path) const = 0;
+        virtual void mlst(std::filesystem::path path) const = 0;
+        virtual void size(std::filesystem::path path) const = 0;
+        virtual void mdtm(std::filesystem::path path) const = 0;
         virtual void noop() const final;
+        virtual void feat() const final;
 
         virtual ~ControlConnectionState() = default;
 
@@ -44,9 +55,15 @@ namespace ftp {
     enum class DataConnectionMode{
         sender,
         receiver,
-        lister
+        lister,
+        //MLSD: the machine-readable listing of RFC 3659.
+        machineLister
     };
 
+    //The RFC 3659 forms of the FileSystemProxy facts: the time as YYYYMMDDHHMMSS in UTC and the MLSx fact list.
+    std::string formatTime(std::int64_t time);
+    std::string formatFacts(const FileSystemProxy::Facts& facts);
+
     class DataConnection;
 
     class ControlConnection: public ConnectionBase {
@@ -54,16 +71,21 @@ namespace ftp {
     public:
         ControlConnection(ConnectionBase* parent,
                       const std::filesystem::path&& root,
-                      const std::shared_ptr<FileSystemProxy>&& fileSystem
+                      const std::shared_ptr<FileSystemProxy>&& fileSystem,
+                      unsigned readAhead = 1,
+                      std::uint64_t directIoThreshold = 0,
+                      std::shared_ptr<ListingCache> listingCache = nullptr
                       ):
                 ConnectionBase(parent),
                 _root(root),
                 _fileSystem(fileSystem),
+                _readAhead(readAhead),
+                _directIoThreshold(directIoThreshold),
+                _listingCache(std::move(listingCache)),
                 _command(std::make_shared<std::string>()),
                 _pasvFD(-1)
         {
             _command->clear();
-            _command->reserve(500);
         }
 
         //Starts an asynchronous FTP ControlConnection
@@ -80,15 +102,31 @@ namespace ftp {
         }
         std::shared_ptr<FileSystemProxy> fileSystem() { return _fileSystem; }
 
-        void postDataSendTask(std::filesystem::path&& path, DataConnectionMode mode, std::function<void()>&& dataTransferEndCallback);
+        void postDataSendTask(std::filesystem::path&& path, DataConnectionMode mode, std::function<void()>&& dataTransferEndCallback,
+                              std::uint64_t restartOffset = 0);
+
+        //Stats the root-relative path through the ring. cb gets 0 or -errno along with the mode of the file.
+        void statPath(const std::filesystem::path& relativePath, std::function<void(int, std::uint16_t)>&& cb);
 
         void makePasv();
 
         void setStructure(FileStructure structure) noexcept { _structure = structure; }
         void setRepresentationType(RepresentationType type) noexcept { _type = type; }
+        [[nodiscard]] RepresentationType representationType() const noexcept { return _type; }
+
+        //The REST marker applies to the next RETR or STOR only.
+        void setRestartOffset(std::uint64_t offset) noexcept { _restartOffset = offset; }
+        std::uint64_t takeRestartOffset() noexcept { return std::exchange(_restartOffset, 0); }
 
-        Callback defaultAsyncOpHandler = [this](std::size_t res){
+        //Handlers kept for the whole connection are std::functions: every operation takes its own copy.
+        std::function<void(std::int64_t)> defaultAsyncOpHandler = [this](std::size_t res){
             if(res == -1) stop();
+            if(_inbox) {
+                //The reply is out - move on to the next command if it has already arrived.
+                _processing = false;
+                processPending();
+                return;
+            }
             _ring->async_read_until(
                     _fd,
                     std::move(_command),
@@ -97,27 +135,57 @@ namespace ftp {
             );
         };
 
-        void stop() override {
-            if(_pasvFD >= 0)
-                close(_pasvFD);
-            ConnectionBase::stop();
-        }
+        void stop() override;
 
     protected:
 
         void startActing() override;
 
     private:
+        //Takes the next complete command out of _inbox and processes it, unless a command is already in progress.
+        void processPending();
+
+        //Expects _pasvMutex to be held.
+        void closePasv() {
+            if(_pasvFD >= 0) {
+                //Shutting the listening socket down ends the accept still armed on it.
+                shutdown(_pasvFD, SHUT_RDWR);
+                close(_pasvFD);
+                _pasvFD = -1;
+            }
+        }
+
+        //Filled by the multishot recv if the ring has provided buffers. Otherwise the commands are read one by one
+        //into _command with async_read_until().
+        std::shared_ptr<RecvQueue> _inbox;
+        //The multishot recv holds the socket until its last completion, which stop() brings about by shutting the
+        //socket down. The descriptor is only closed then, so the recv can never be re-armed on a reused number.
+        std::mutex _stopMutex;
+        bool _receiving = false;
+        int _lingeringFd = -1;
+        std::atomic<bool> _stopped{false};
+        //Set from the moment a command is taken until its reply is sent, which keeps the commands in order.
+        std::atomic<bool> _processing{false};
         std::unique_ptr<ControlConnectionState> _state;
         std::filesystem::path _pwd;
         std::filesystem::path _root;
         std::shared_ptr<std::string> _command;
         RepresentationType _type;
+        std::uint64_t _restartOffset = 0;
         FileStructure _structure;
         TransferMode _mode;
+        //_pasvFD, _currentPasvChild and _pendingDataTask are guarded by _pasvMutex.
         int _pasvFD;
         std::shared_ptr<DataConnection> _currentPasvChild;
+        //A data transfer requested before the client connected to the PASV socket.
+        std::function<void()> _pendingDataTask;
+        std::mutex _pasvMutex;
         std::shared_ptr<FileSystemProxy> _fileSystem;
+        //Queue depth of the read-ahead sender of the data connections.
+        unsigned _readAhead;
+        //Size from which the downloads go through the file ring, 0 if never.
+        std::uint64_t _directIoThreshold;
+        std::shared_ptr<ListingCache> _listingCache;
     };
 
     class DataConnection: public ConnectionBase{
@@ -125,30 +193,121 @@ namespace ftp {
 
         DataConnection(ConnectionBase* parent,
                        std::shared_ptr<FileSystemProxy>&& fileSystem,
+                       unsigned readAhead = 1,
+                       std::uint64_t directIoThreshold = 0,
+                       std::shared_ptr<ListingCache> listingCache = nullptr,
                        std::function<void(void)>&& waitingForConnectionCallback = [](){}
         );
 
         void command(std::filesystem::path&& pathToFile,
                      DataConnectionMode mode,
                      RepresentationType _type,
+                     std::uint64_t restartOffset,
                      std::function<void(void)>&& dataTransmissionEndCallback);
 
+        //Bytes moved by a single splice round of the zero-copy sender.
+        static constexpr std::size_t spliceChunkSize = 1UL << 16;
+        //Outbound buffers from this size on are sent with IORING_OP_SEND_ZC, smaller ones are cheaper to copy.
+        static constexpr std::size_t zeroCopyThreshold = 1UL << 14;
+        //File bytes read into a single heap slot of the read-ahead sender.
+        static constexpr std::size_t readAheadChunkSize = 1UL << 16;
+        //The offsets of the O_DIRECT reads have to be aligned to the logical block size, which this is a multiple of
+        //on any device the large-file mode is meant for.
+        static constexpr std::uint64_t directIoAlignment = 4096;
+
     protected:
 
         void startActing() override {}
 
-        Callback continue_transmission;
+        std::function<void(std::int64_t)> continue_transmission;
 
     private:
+        //Picks the transfer strategy once the file is open.
+        void startTransfer();
+        //Releases the transfer resources, reports the end of the transfer and closes the connection.
+        void endTransmission();
+
+        //Zero-copy sender: pumps the file through _pipe into the socket chunk by chunk until the end of the file.
+        Task spliceFile();
+        bool openPipe();
+
+        //Writes the user space buffer to the socket, choosing a zero-copy send for large buffers.
+        void sendBuffer();
+
+        //Lister: sends the listing of the directory _pathToFile, from the cache if possible, and ends the transfer.
+        void sendListing();
+        //Machine lister: sends the MLSD listing of _pathToFile, built from the FileSystemProxy metadata.
+        void sendMachineListing();
+        void writeListing(std::shared_ptr<std::string>&& listing);
+
+        //Convert _buffer between the local and the network line ends of the ASCII type, through _converted.
+        void encodeBuffer();
+        void decodeBuffer();
+
+        //A single read->write round of the Image type transfer through the registered _transferBuffer.
+        void transferFixed();
+        //Writes the chunk of the round on from the byte written, until the whole of it has made it to the destination.
+        void writeFixedRest(int destination, std::uint64_t writeOffset, std::size_t size, std::size_t written);
+
+        //Read-ahead sender: keeps up to _readAhead file reads in flight while the chunks read so far are written to the
+        //socket one at a time, in file order.
+        struct ReadAheadSlot {
+            //Registered buffer if the pool had one to spare, a heap buffer otherwise.
+            std::shared_ptr<BufferPool::Buffer> fixed;
+            std::shared_ptr<std::string> heap;
+            std::uint64_t offset = 0;
+            //Bytes read, -1 while the read is in flight.
+            std::int64_t length = -1;
+        };
+        //Large-file mode: switches the file to O_DIRECT if it is big enough and every slot got a registered buffer.
+        //The reads of the read-ahead sender then go to the file ring.
+        bool startDirectIo();
+        void startReadAhead();
+        //All five expect _readAheadMutex to be held.
+        void readSlot(std::size_t index);
+        //Moves on to the slot after the one being written and puts the finished one to reading the next chunk.
+        void releaseSlot();
+        //Posts the read of the slot at its offset.
+        void postRead(std::size_t index);
+        //Returns true once the transfer is over and no operation refers to the slots any more.
+        bool writeNextSlot();
+        //Writes the chunk of the next slot from the byte written on, re-issuing short writes until the whole of it is out.
+        //outgoing is the heap buffer holding the chunk, unused for the registered slots.
+        void writeChunk(std::shared_ptr<std::string> outgoing, std::size_t size, std::size_t written, bool zeroCopy);
+
         std::filesystem::path _pathToFile;
         std::shared_ptr<FileSystemProxy> _fileSystem;
         DataConnectionMode _mode;
         std::function<void(void)> _dataTransmissionEndCallback;
         int _fileFd;
-        FILE* _fileStruct;
         std::shared_ptr<std::string> _buffer;
+        std::shared_ptr<std::string> _converted;
+        LineEndingEncoder _encoder;
+        LineEndingDecoder _decoder;
         std::uint64_t _bytesRead;
         RepresentationType _type;
+        std::shared_ptr<BufferPool::Buffer> _transferBuffer;
+        std::array<int, 2> _pipe{-1, -1};
+        std::int64_t _pipeFill = 0;
+        unsigned _readAhead;
+        std::vector<ReadAheadSlot> _slots;
+        //Slot to be written next.
+        std::size_t _nextSlot = 0;
+        std::uint64_t _readOffset = 0;
+        //Set by the first short read, nothing past it gets sent.
+        std::uint64_t _eofOffset = 0;
+        unsigned _readsInFlight = 0;
+        bool _writing = false;
+        //File offset the chunk being written ends at.
+        std::uint64_t _chunkEnd = 0;
+        //The chunk being written was copied out of its slot, which already reads the next one.
+        bool _slotReleased = false;
+        bool _failed = false;
+        //The file is open with O_DIRECT and read through the file ring.
+        bool _direct = false;
+        std::uint64_t _directIoThreshold;
+        std::mutex _readAheadMutex;
+        std::shared_ptr<ListingCache> _listingCache;
     };
 
 }
@@ -0,0 +1,68 @@
+#ifndef URING_TCP_SERVER_DIRECTORYLISTER_H
+#define URING_TCP_SERVER_DIRECTORYLISTER_H
+
+#include <AsyncUring.h>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace ftp {
+
+    /**
+     * DirectoryLister - produces the "ls -l" listing of a directory in process. The names are enumerated with
+     * getdents64 and their metadata is collected with IORING_OP_STATX on the ring, statxBatch entries at a time.
+     * Like ls, it leaves out the entries whose names start with a dot.
+     */
+    class DirectoryLister: public std::enable_shared_from_this<DirectoryLister> {
+    public:
+        using ListingCallback = std::function<void(std::shared_ptr<std::string>&&)>;
+
+        /**
+         * list - lists the directory asynchronously.
+         * @param crlf - end the lines with CRLF rather than LF
+         * @param cb - receives the listing, which is empty if the directory could not be read
+         */
+        static void list(const std::shared_ptr<AsyncUring>& ring, const std::filesystem::path& directory, bool crlf,
+                         ListingCallback&& cb);
+
+        //STATX operations in flight at once.
+        static constexpr std::size_t statxBatch = 64;
+
+        DirectoryLister(const DirectoryLister&) = delete;
+        DirectoryLister& operator=(const DirectoryLister&) = delete;
+
+        ~DirectoryLister();
+
+    private:
+        struct Entry {
+            std::string name;
+            struct statx stat{};
+            //Result of the STATX, entries that failed are left out.
+            int result = 0;
+        };
+
+        DirectoryLister(std::shared_ptr<AsyncUring> ring, bool crlf, ListingCallback&& cb):
+                _ring(std::move(ring)), _crlf(crlf), _cb(std::move(cb)) {}
+
+        //Reads the names of the entries. Returns false if the directory could not be opened.
+        bool readEntries(const std::filesystem::path& directory);
+        //Posts the STATX operations of the next batch, or reports the listing when there is none left.
+        void statNextBatch();
+        void format(std::string& listing) const;
+
+        std::shared_ptr<AsyncUring> _ring;
+        bool _crlf;
+        ListingCallback _cb;
+        int _directoryFd = -1;
+        std::vector<Entry> _entries;
+        std::size_t _nextEntry = 0;
+        std::atomic<std::size_t> _pending{0};
+    };
+
+}
+
+#endif //URING_TCP_SERVER_DIRECTORYLISTER_H
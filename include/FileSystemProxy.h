@@ -12,12 +12,46 @@
 #include <filesystem>
 #include <cassert>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include <vector>
+#include <deque>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include <optional>
+#include <set>
+#include <MetadataIndex.h>
+#include <AsyncUring.h>
 
 namespace ftp {
 
     using namespace std::filesystem;
 
+    //A path along with its hash, which is computed once when the key is made rather than on every lookup.
+    struct HashedPath {
+        HashedPath() = default;
+        HashedPath(path p): _path(std::move(p)), _hash(hash_value(_path)) {} // NOLINT(google-explicit-constructor)
+
+        bool operator==(const HashedPath& other) const { return _hash == other._hash && _path == other._path; }
+
+        struct Hash {
+            std::size_t operator()(const HashedPath& key) const noexcept { return key._hash; }
+        };
+
+        path _path;
+        std::size_t _hash = 0;
+    };
+
+    /**
+     * FileSystemProxy - the versioned file table of the FTP sandbox. The table is split into shardCount shards,
+     * picked by the hash of the path (or by the descriptor for the open file tables), each under a lock of its own,
+     * so transfers of unrelated files never wait for each other. Opening for reading only takes the shard shared.
+     * What the table does not know is looked up on disk by the worker threads, never by the caller.
+     */
     class FileSystemProxy {
     public:
         enum class OpenMode {
@@ -25,55 +59,240 @@ namespace ftp {
             writeonly
         };
 
-        explicit FileSystemProxy(const path &path) {
+        //How the file table is filled.
+        enum class IndexingMode {
+            //Walks the whole tree in the constructor.
+            eager,
+            //Indexes a directory the first time it is touched.
+            lazy,
+            //Walks the tree on background threads, indexing the directories touched meanwhile on demand.
+            parallel
+        };
+
+        struct IndexingProgress {
+            std::uint64_t directories = 0;
+            std::uint64_t files = 0;
+            //The whole tree is indexed, which the lazy mode never reports.
+            bool done = false;
+        };
+
+        //What MLSD/MLST/SIZE/MDTM report about a file or a directory, known without touching the disk.
+        struct Facts {
+            std::string name;
+            bool directory = false;
+            std::uint64_t size = 0;
+            //Last modification, in seconds since the epoch.
+            std::int64_t modified = 0;
+        };
+
+        /**
+         * @param workerThreads - threads looking up on disk what the table does not know, which also walk the tree
+         * in the parallel mode
+         */
+        explicit FileSystemProxy(const path &path, IndexingMode mode = IndexingMode::eager,
+                                 unsigned workerThreads = std::thread::hardware_concurrency()): _mode(mode) {
             assert(path.has_filename());
             assert(path.has_root_path());
             assert(exists(path));
             _root = path;
-            loadFileTable();
+            loadPersistedIndex();
+            if (mode == IndexingMode::eager) {
+                loadFileTable();
+                _indexingDone = true;
+            } else if (mode == IndexingMode::parallel)
+                startIndexing();
+            for (unsigned i = 0; i < std::max(workerThreads, 1U); i++)
+                _workers.emplace_back([this](const std::stop_token &stop) { workQueued(stop); });
         }
 
+        using OpenCallback = std::function<void(int fd)>;
+        using FactsCallback = std::function<void(std::optional<Facts> &&facts)>;
+        using DirectoryFactsCallback = std::function<void(std::optional<std::vector<Facts>> &&facts)>;
+
         /**
-         * open - opens the latest file in selected mode
+         * open - opens the latest file in selected mode through the ring. A file missing from the table is looked
+         * up on a worker thread, which cb may then be called on.
          * @param relativePath - path to the file inside the FTP sandbox. Should not end with /
-         * @return ind fd - file descriptor of the opened file.
+         * @param cb - gets the file descriptor of the opened file, or -1
+         * @param keptBytes - for writing: how many leading bytes of the latest version the new one starts with,
+         * which is how an upload restarted by REST resumes
          */
-        int open(const path &relativePath, OpenMode mode);
+        void open(const std::shared_ptr<AsyncUring> &ring, const path &relativePath, OpenMode mode, OpenCallback &&cb,
+                  std::uint64_t keptBytes = 0);
+
+        /**
+         * close - closes the file through the ring. A file opened for writing becomes the latest version.
+         * @param cb - called once the table is up to date, i.e. the new version is visible to open()
+         */
+        void close(const std::shared_ptr<AsyncUring> &ring, int fd, std::function<void()> &&cb = nullptr);
+
+        [[nodiscard]] const path& root() const noexcept { return _root; }
+
+        [[nodiscard]] IndexingProgress indexingProgress() const noexcept {
+            return {_indexedDirectories.load(std::memory_order_relaxed), _indexedFiles.load(std::memory_order_relaxed),
+                    _indexingDone.load(std::memory_order_acquire)};
+        }
+
+        //Facts of the latest version of a file, or of a directory. Empty if the path is unknown.
+        //cb is called at once if the table knows the answer, otherwise from a completion of ring after a worker has
+        //looked at the disk.
+        void facts(const std::shared_ptr<AsyncUring> &ring, const path& relativePath, FactsCallback &&cb);
+        //Facts of every entry of a directory. Empty if the path is not a known directory. Called back as facts() is.
+        void directoryFacts(const std::shared_ptr<AsyncUring> &ring, const path& relativePath,
+                            DirectoryFactsCallback &&cb);
+        //What the table knows about the path, without a look at the disk.
+        std::optional<Facts> knownFacts(const path& relativePath);
 
-        void close(int fd);
+        //Called by close() with the root-relative path of every file whose new version it has just committed.
+        void setCommitHook(std::function<void(const path&)>&& hook) { _commitHook = std::move(hook); }
+
+        static constexpr std::size_t shardCount = 64;
 
         ~FileSystemProxy() {
+            //Stops and joins the workers, along with the background indexing if any.
+            _workers.clear();
             //Before the destruction of filesystem, it copies all the latest versions of files to their target
             //destinations, dropping the ones that are outdated.
-            for (const auto &it: _fileTable) {
-                for (const auto &iter: it.second)
-                    if (iter == it.second.back())
-                        std::filesystem::rename(iter->_truePath, _root / iter->_keyPath);
-                    else remove(iter->_truePath);
-            }
+            std::set<path> changedDirectories;
+            for (const auto &shard: _fileShards)
+                for (const auto &it: shard._fileTable) {
+                    for (const auto &iter: it.second)
+                        if (iter == it.second.back()) {
+                            if (iter->_truePath == _root / iter->_keyPath._path)
+                                continue;
+                            std::filesystem::rename(iter->_truePath, _root / iter->_keyPath._path);
+                            iter->_truePath = _root / iter->_keyPath._path;
+                            changedDirectories.insert(iter->_keyPath._path.parent_path());
+                        } else remove(iter->_truePath);
+                }
+            persistIndex(changedDirectories);
         }
 
     private:
 
         struct FTPFileEntry {
-            path _keyPath;
+            HashedPath _keyPath;
             path _truePath;
+            std::uint64_t _size = 0;
+            std::int64_t _modified = 0;
+        };
+
+        //The directory tree of the sandbox, each directory keyed by its root-relative path ("" being the root).
+        struct FTPDirectoryEntry {
+            std::set<std::string> _files;
+            //Subdirectory names along with their modification times, known before the subdirectories are indexed.
+            std::map<std::string, std::int64_t> _directories;
+            std::int64_t _modified = 0;
+            //The mtime of the directory in nanoseconds before it was read, to tell the next run if it has changed.
+            std::int64_t _stamp = 0;
+        };
+
+        using FileVersions = std::vector<std::shared_ptr<FTPFileEntry>>;
+
+        //The versions of the files whose path hashes fall into the shard.
+        struct FileShard {
+            std::shared_mutex _mutex;
+            std::unordered_map<HashedPath, FileVersions, HashedPath::Hash> _fileTable;
+            std::unordered_map<HashedPath, std::shared_ptr<FTPFileEntry>, HashedPath::Hash> _filesBeingEdited;
         };
 
+        //The open descriptors that fall into the shard.
+        struct DescriptorShard {
+            std::mutex _mutex;
+            std::unordered_map<int, std::shared_ptr<FTPFileEntry>> _fdTable;
+            std::unordered_map<int, std::shared_ptr<FTPFileEntry>> _fdsBeingEdited;
+        };
+
+        FileShard& shardOf(const HashedPath& key) noexcept { return _fileShards[key._hash % shardCount]; }
+        DescriptorShard& shardOf(int fd) noexcept { return _descriptorShards[unsigned(fd) % shardCount]; }
+
         path _root;
-        std::map<path, std::vector<std::shared_ptr<FTPFileEntry>>> _fileTable;
-        std::map<int, std::shared_ptr<FTPFileEntry>> _fdTable;
-        std::map<int, std::shared_ptr<FTPFileEntry>> _fdsBeingEdited;
-        std::map<path, std::shared_ptr<FTPFileEntry>> _filesBeingEdited;
-        std::mutex _filesystemMutex;
+        std::array<FileShard, shardCount> _fileShards;
+        std::array<DescriptorShard, shardCount> _descriptorShards;
+        std::map<path, FTPDirectoryEntry> _directoryIndex;
+        std::shared_mutex _directoryMutex;
+        std::function<void(const path&)> _commitHook;
+
+        IndexingMode _mode;
+        std::atomic<std::uint64_t> _indexedDirectories{0};
+        std::atomic<std::uint64_t> _indexedFiles{0};
+        std::atomic<bool> _indexingDone{false};
+        //The queue of the workers: the lookups, served first, and the directories of the parallel walk.
+        //_unfinishedDirectories counts the queued directories and those being indexed.
+        std::mutex _queueMutex;
+        std::condition_variable_any _queueChanged;
+        std::deque<std::function<void()>> _jobs;
+        std::vector<path> _pendingDirectories;
+        std::size_t _unfinishedDirectories = 0;
+        std::vector<std::jthread> _workers;
+        //The directories whose indexing has failed during the walk, so that neither they nor their subtrees are known.
+        //Indexed on first touch, even after the walk is over.
+        std::set<path> _unindexedSubtrees;
+        //The table saved by the previous run, nullptr if there is none.
+        std::unique_ptr<MetadataIndex> _persistedIndex;
 
         void loadFileTable(const path &relPath = "");
 
+        //Creates the directory along with the missing parents, cb gets 0 or -errno.
+        void makeDirectories(const std::shared_ptr<AsyncUring> &ring, const path &directory,
+                             std::function<void(int)> &&cb);
+        //Registers the descriptor of a new version, which becomes the one being edited.
+        void trackEdited(int fd, std::shared_ptr<FTPFileEntry> &&file);
+        //Puts the committed file into the table and unlinks the versions nobody reads anymore.
+        void commitVersion(const std::shared_ptr<AsyncUring> &ring, const std::shared_ptr<FTPFileEntry> &file);
+
+        /**
+         * indexDirectory - adds a directory to _directoryIndex and the versions of its files to the table
+         * @return the root-relative paths of the subdirectories, also when the directory has already been indexed
+         */
+        std::vector<path> indexDirectory(const path &relPath);
+
+        //Fills the directory entry from the persisted index. Returns false if it has no valid record of the directory.
+        bool adoptPersisted(const path &relPath, FTPDirectoryEntry &directory);
+        //Adds the indexed directory, unless somebody else has been first.
+        void addDirectory(const path &relPath, FTPDirectoryEntry &&directory);
+
+        [[nodiscard]] path persistedIndexPath() const { return _root / ".tmp" / ".ftp-index"; }
+        //Maps the index saved by the previous run and unlinks it, so that a crash leaves no stale index behind.
+        void loadPersistedIndex();
+        /**
+         * persistIndex - saves the table for the next run, along with the records of the previous run for the
+         * directories not touched by this one.
+         * @param changedDirectories - the directories the destructor has renamed the new versions into
+         */
+        void persistIndex(const std::set<path> &changedDirectories);
+
+        //Indexes the directory on first touch until the whole tree is known. Returns false if it is not a directory.
+        bool ensureIndexed(const path &relPath);
+        //Whether the path may lie in a part of the tree that is not indexed, so that the disk has to be asked about it.
+        bool mayBeUnindexed(const path &relPath);
+
+        void startIndexing();
+        //The loop of a worker: runs the queued lookups and indexes the directories of the walk until stopped.
+        void workQueued(const std::stop_token &stop);
+        //Indexes a directory of the parallel walk and queues its subdirectories.
+        void indexQueued(path &&directory);
+        //Runs the job on a worker thread.
+        void post(std::function<void()> &&job);
+
+        //Opens the latest of the versions found for the file, the rest of open().
+        void openVersion(const std::shared_ptr<AsyncUring> &ring, const HashedPath &key, FileVersions &&versions,
+                         OpenMode mode, OpenCallback &&cb, std::uint64_t keptBytes);
+        //facts() and directoryFacts() as they are answered on a worker, indexing and reading the disk as needed.
+        std::optional<Facts> lookupFacts(const path &relativePath);
+        std::optional<std::vector<Facts>> lookupDirectoryFacts(const path &relativePath);
+
         /**
          * updateFileTable - private class member function that adds info about the files on disk
-         * @param relativePath - FTP-root-relative path to file of interest, should not end with /
+         * @param key - FTP-root-relative path to file of interest, should not end with /
+         * @return the versions in the table, which may have been added by someone else meanwhile. A file found on
+         * disk in no version is left out of the table, so that the lookups of missing names do not grow it.
          */
-        void updateFileTable(const path &relativePath);
+        FileVersions updateFileTable(const HashedPath &key);
+
+        //Collects the versions of the file found on disk, oldest first, removing the outdated ones.
+        //Expects the shard of the file to be held exclusively.
+        FileVersions readVersions(const FileShard &shard, const HashedPath &key);
     };
 
 }
@@ -0,0 +1,116 @@
+#ifndef URING_TCP_SERVER_INLINEFUNCTION_H
+#define URING_TCP_SERVER_INLINEFUNCTION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ftp {
+
+    template<typename Signature, std::size_t Capacity = 48>
+    class InlineFunction;
+
+    /**
+     * InlineFunction - a move-only replacement for std::function, which keeps callables of up to Capacity bytes
+     * in place, so wrapping a lambda (or a std::function) costs no allocation. Larger callables go to the heap.
+     */
+    template<typename R, typename... Args, std::size_t Capacity>
+    class InlineFunction<R(Args...), Capacity> {
+    public:
+        InlineFunction() noexcept = default;
+        InlineFunction(std::nullptr_t) noexcept {} // NOLINT(google-explicit-constructor)
+
+        template<typename F, typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, InlineFunction> &&
+                std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+        InlineFunction(F&& f) { // NOLINT(google-explicit-constructor)
+            emplace<std::decay_t<F>>(std::forward<F>(f));
+        }
+
+        InlineFunction(InlineFunction&& other) noexcept { take(other); }
+
+        InlineFunction& operator=(InlineFunction&& other) noexcept {
+            if(this != &other) {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+
+        InlineFunction& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        InlineFunction(const InlineFunction&) = delete;
+        InlineFunction& operator=(const InlineFunction&) = delete;
+
+        ~InlineFunction() { reset(); }
+
+        R operator()(Args... args) { return _ops->invoke(_storage, std::forward<Args>(args)...); }
+
+        explicit operator bool() const noexcept { return _ops != nullptr; }
+
+    private:
+        struct Ops {
+            R (*invoke)(void* storage, Args&&... args);
+            //Move-constructs the callable into to and destroys the one left in from.
+            void (*relocate)(void* from, void* to) noexcept;
+            void (*destroy)(void* storage) noexcept;
+        };
+
+        template<typename F>
+        static constexpr bool storedInPlace = sizeof(F) <= Capacity &&
+                                              alignof(F) <= alignof(std::max_align_t) &&
+                                              std::is_nothrow_move_constructible_v<F>;
+
+        template<typename F, typename G>
+        void emplace(G&& f) {
+            if constexpr (storedInPlace<F>) {
+                ::new(static_cast<void*>(_storage)) F(std::forward<G>(f));
+                static constexpr Ops ops{
+                        [](void* storage, Args&&... args) -> R {
+                            return std::invoke(*static_cast<F*>(storage), std::forward<Args>(args)...);
+                        },
+                        [](void* from, void* to) noexcept {
+                            ::new(to) F(std::move(*static_cast<F*>(from)));
+                            static_cast<F*>(from)->~F();
+                        },
+                        [](void* storage) noexcept { static_cast<F*>(storage)->~F(); }
+                };
+                _ops = &ops;
+            } else {
+                //The storage keeps the owning pointer only.
+                ::new(static_cast<void*>(_storage)) F*(new F(std::forward<G>(f)));
+                static constexpr Ops ops{
+                        [](void* storage, Args&&... args) -> R {
+                            return std::invoke(**static_cast<F**>(storage), std::forward<Args>(args)...);
+                        },
+                        [](void* from, void* to) noexcept { ::new(to) F*(*static_cast<F**>(from)); },
+                        [](void* storage) noexcept { delete *static_cast<F**>(storage); }
+                };
+                _ops = &ops;
+            }
+        }
+
+        void take(InlineFunction& other) noexcept {
+            if(other._ops) {
+                other._ops->relocate(other._storage, _storage);
+                _ops = std::exchange(other._ops, nullptr);
+            }
+        }
+
+        void reset() noexcept {
+            if(_ops)
+                std::exchange(_ops, nullptr)->destroy(_storage);
+        }
+
+        alignas(std::max_align_t) std::byte _storage[Capacity];
+        const Ops* _ops = nullptr;
+    };
+
+}
+
+#endif //URING_TCP_SERVER_INLINEFUNCTION_H
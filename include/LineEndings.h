@@ -0,0 +1,46 @@
+#ifndef URING_TCP_SERVER_LINEENDINGS_H
+#define URING_TCP_SERVER_LINEENDINGS_H
+
+#include <string>
+#include <string_view>
+
+namespace ftp {
+
+    /**
+     * LineEndingEncoder - converts a stream of local text (LF line ends) into the network form of the ASCII type
+     * (CRLF line ends), a chunk at a time. Line ends already in the CRLF form are passed on untouched, also when
+     * the pair is split between two chunks.
+     */
+    class LineEndingEncoder {
+    public:
+        //Appends the converted input to output.
+        void encode(std::string_view input, std::string& output);
+
+        //Forgets the state carried over from the previous chunk, ready for a new stream.
+        void reset() noexcept { _previousCR = false; }
+
+    private:
+        bool _previousCR = false;
+    };
+
+    /**
+     * LineEndingDecoder - the reverse of LineEndingEncoder: turns the CRLF pairs of the stream into LF and passes
+     * lone CRs on. A CR ending a chunk is held back until the next chunk shows whether an LF follows it.
+     */
+    class LineEndingDecoder {
+    public:
+        //Appends the converted input to output.
+        void decode(std::string_view input, std::string& output);
+
+        //Appends whatever is held back at the end of the stream.
+        void finish(std::string& output);
+
+        void reset() noexcept { _pendingCR = false; }
+
+    private:
+        bool _pendingCR = false;
+    };
+
+}
+
+#endif //URING_TCP_SERVER_LINEENDINGS_H
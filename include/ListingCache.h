@@ -0,0 +1,73 @@
+#ifndef URING_TCP_SERVER_LISTINGCACHE_H
+#define URING_TCP_SERVER_LISTINGCACHE_H
+
+#include <AsyncUring.h>
+#include <array>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ftp {
+
+    /**
+     * ListingCache - keeps the formatted LIST payloads of the directories, keyed by the root-relative path (as made
+     * by parsePath) and the line end style. A cached listing is shared by everyone serving it and never modified.
+     * The listed directories are watched with inotify, whose events are read through the ring, so a change on disk
+     * drops the listings of the directory and of its parent (which shows its mtime).
+     */
+    class ListingCache: public std::enable_shared_from_this<ListingCache> {
+    public:
+        //Throws std::system_error if inotify is unavailable.
+        explicit ListingCache(std::filesystem::path root);
+
+        //Starts reading the inotify events through the ring.
+        void start(const std::shared_ptr<AsyncUring>& ring);
+
+        //Returns the cached listing or nullptr.
+        std::shared_ptr<std::string> find(const std::filesystem::path& directory, bool crlf);
+
+        /**
+         * watch - makes sure the directory is watched before its listing is produced, so no change is missed.
+         * @return the generation to be passed to store(), or noGeneration if the directory cannot be watched
+         */
+        std::uint64_t watch(const std::filesystem::path& directory);
+
+        //Caches the listing, unless anything was invalidated since watch() returned the generation.
+        void store(const std::filesystem::path& directory, bool crlf, std::shared_ptr<std::string> listing,
+                   std::uint64_t generation);
+
+        //Drops the listings of the directory and of its parent.
+        void invalidate(const std::filesystem::path& directory);
+
+        static constexpr std::uint64_t noGeneration = UINT64_MAX;
+        //Directories cached at once. Reaching the limit starts the cache over.
+        static constexpr std::size_t maxEntries = 1024;
+
+        ListingCache(const ListingCache&) = delete;
+        ListingCache& operator=(const ListingCache&) = delete;
+
+        ~ListingCache();
+
+    private:
+        void readEvents();
+        //Both expect _mutex to be held.
+        void dropListings(const std::string& directory);
+        void clear();
+
+        std::filesystem::path _root;
+        int _inotifyFd;
+        std::shared_ptr<AsyncUring> _ring;
+        std::shared_ptr<std::string> _events;
+        std::mutex _mutex;
+        //Indexed by the crlf flag.
+        std::unordered_map<std::string, std::array<std::shared_ptr<std::string>, 2>> _listings;
+        std::unordered_map<int, std::string> _watchedPaths;
+        std::unordered_map<std::string, int> _watches;
+        std::uint64_t _generation = 0;
+    };
+
+}
+
+#endif //URING_TCP_SERVER_LISTINGCACHE_H
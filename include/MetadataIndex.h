@@ -0,0 +1,120 @@
+#ifndef URING_TCP_SERVER_METADATAINDEX_H
+#define URING_TCP_SERVER_METADATAINDEX_H
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ftp {
+
+    /**
+     * MetadataIndex - the file table of FileSystemProxy as saved on disk by the previous run, mapped read-only.
+     * The file is a header followed by arrays of fixed size records and a blob of the strings they refer to:
+     * the directories (sorted by their root-relative path), their subdirectories, their files and the versions of
+     * the files, oldest first. A directory record is only trusted while its stamp matches the mtime of the directory.
+     */
+    class MetadataIndex {
+    public:
+        struct StringRef {
+            std::uint64_t offset;
+            std::uint32_t length;
+            std::uint32_t reserved;
+        };
+
+        struct DirectoryRecord {
+            StringRef path;
+            //The mtime of the directory in nanoseconds when it was read, 0 if it has to be read again.
+            std::int64_t stamp;
+            std::int64_t modified;
+            std::uint64_t firstSubdirectory;
+            std::uint64_t subdirectoryCount;
+            std::uint64_t firstFile;
+            std::uint64_t fileCount;
+        };
+
+        struct SubdirectoryRecord {
+            StringRef name;
+            std::int64_t modified;
+        };
+
+        struct FileRecord {
+            StringRef name;
+            std::uint64_t firstVersion;
+            std::uint64_t versionCount;
+        };
+
+        struct VersionRecord {
+            //Relative to the FTP root.
+            StringRef truePath;
+            std::uint64_t size;
+            std::int64_t modified;
+        };
+
+        //Maps the index. Returns nullptr if there is none or it is not a valid index of this format.
+        static std::unique_ptr<MetadataIndex> open(const std::filesystem::path& file);
+
+        //Returns the record of the directory or nullptr.
+        [[nodiscard]] const DirectoryRecord* find(std::string_view directory) const;
+
+        [[nodiscard]] std::span<const DirectoryRecord> directories() const noexcept { return _directories; }
+        [[nodiscard]] std::span<const SubdirectoryRecord> subdirectories(const DirectoryRecord& directory) const noexcept {
+            return _subdirectories.subspan(directory.firstSubdirectory, directory.subdirectoryCount);
+        }
+        [[nodiscard]] std::span<const FileRecord> files(const DirectoryRecord& directory) const noexcept {
+            return _files.subspan(directory.firstFile, directory.fileCount);
+        }
+        [[nodiscard]] std::span<const VersionRecord> versions(const FileRecord& file) const noexcept {
+            return _versions.subspan(file.firstVersion, file.versionCount);
+        }
+        [[nodiscard]] std::string_view string(const StringRef& ref) const noexcept {
+            return _strings.substr(ref.offset, ref.length);
+        }
+
+        MetadataIndex(const MetadataIndex&) = delete;
+        MetadataIndex& operator=(const MetadataIndex&) = delete;
+
+        ~MetadataIndex();
+
+    private:
+        MetadataIndex(void* mapping, std::size_t size): _mapping(mapping), _size(size) {}
+
+        //Checks that every record refers to the data within the mapping.
+        [[nodiscard]] bool valid() const noexcept;
+
+        void* _mapping;
+        std::size_t _size;
+        std::span<const DirectoryRecord> _directories;
+        std::span<const SubdirectoryRecord> _subdirectories;
+        std::span<const FileRecord> _files;
+        std::span<const VersionRecord> _versions;
+        std::string_view _strings;
+    };
+
+    //Collects the records in the order they are added, i.e. every directory followed by its entries.
+    class MetadataIndexWriter {
+    public:
+        void addDirectory(std::string_view path, std::int64_t stamp, std::int64_t modified);
+        void addSubdirectory(std::string_view name, std::int64_t modified);
+        void addFile(std::string_view name);
+        void addVersion(std::string_view truePath, std::uint64_t size, std::int64_t modified);
+
+        //Writes the index next to the file and renames it into place. Returns false on failure.
+        bool write(const std::filesystem::path& file);
+
+    private:
+        MetadataIndex::StringRef addString(std::string_view string);
+
+        std::vector<MetadataIndex::DirectoryRecord> _directories;
+        std::vector<MetadataIndex::SubdirectoryRecord> _subdirectories;
+        std::vector<MetadataIndex::FileRecord> _files;
+        std::vector<MetadataIndex::VersionRecord> _versions;
+        std::string _strings;
+    };
+
+}
+
+#endif //URING_TCP_SERVER_METADATAINDEX_H
@@ -4,64 +4,138 @@
 #include <string>
 #include <thread>
 #include <memory>
+#include <atomic>
 #include <ControlConnection.h>
+#include <ListingCache.h>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/intrusive/set.hpp>
 
 namespace ftp {
 
+    struct ServerOptions {
+        //Number of threads serving the connections.
+        unsigned threads = std::thread::hardware_concurrency();
+        //Gives each thread its own ring and SO_REUSEPORT listening socket instead of sharing a single ring.
+        bool sharded = false;
+        //How the event loop rings submit: interrupted makes a system call per submission, sq_polled trades a kernel
+        //thread per ring for submissions without one. io_polled can not serve sockets.
+        AsyncUring::UringMode ringMode = AsyncUring::UringMode::interrupted;
+        //SQ depth of the event loop rings, a power of two up to 4096.
+        unsigned ringDepth = 1U << 12;
+        //CPUs the SQ threads of the sq_polled rings are bound to, ring i taking the (i % size)-th. Empty leaves them
+        //to the scheduler.
+        std::vector<int> sqThreadCpus;
+        //Polling time of an idle SQ thread before it sleeps, 0 for the kernel default.
+        std::chrono::milliseconds sqThreadIdle{0};
+        //CPUs the event loop threads reaping the completions are bound to, in the same manner.
+        std::vector<int> completionCpus;
+        //Memory registered with the rings for the data transfers. 0 disables the registered buffers.
+        std::size_t bufferPoolBudget = 1UL << 26;
+        //Size of a single registered transfer buffer.
+        std::size_t transferBufferSize = 1UL << 16;
+        //Size of the registered file table of every ring. 0 keeps posting plain descriptors.
+        unsigned fixedFiles = 0;
+        //Provided buffers shared by the control connections of a ring for their multishot receives.
+        unsigned controlBufferCount = 256;
+        std::size_t controlBufferSize = 1UL << 10;
+        //File chunks a sender keeps in flight ahead of the socket. 1 reads and writes the chunks in turn.
+        unsigned readAhead = 4;
+        //Downloads of files from this size on read the file with O_DIRECT on an IOPOLL ring of their own, keeping
+        //the page cache for the small hot files. 0 disables the large-file mode.
+        std::uint64_t directIoThreshold = 0;
+        //SQ depth of the IOPOLL rings of the large-file mode.
+        unsigned directIoDepth = 256;
+        //How the file table is filled, eagerly before the server starts by default.
+        FileSystemProxy::IndexingMode indexing = FileSystemProxy::IndexingMode::eager;
+        //Threads looking up the files the table does not know yet, which also walk the tree in the parallel mode.
+        unsigned indexingThreads = std::thread::hardware_concurrency();
+    };
+
+    //Owns the listening socket of a single event loop and accepts the control connections into its ring.
+    class Listener: public ConnectionBase {
+    public:
+        Listener(ConnectionBase* parent,
+                 std::shared_ptr<AsyncUring>&& ring,
+                 const std::filesystem::path& ftpRoot,
+                 const std::shared_ptr<FileSystemProxy>& fileSystem,
+                 bool reusePort,
+                 unsigned readAhead,
+                 std::uint64_t directIoThreshold,
+                 const std::shared_ptr<ListingCache>& listingCache):
+                ConnectionBase(parent, std::move(ring)),
+                _ftpRoot(ftpRoot),
+                _fileSystem(fileSystem),
+                _reusePort(reusePort),
+                _readAhead(readAhead),
+                _directIoThreshold(directIoThreshold),
+                _listingCache(listingCache) {}
+
+        //Opens the listening socket and posts the first accept.
+        void start() override;
+
+    protected:
+        void startActing() override {};
+
+        void childAccepted(ConnectionBase* child) override;
+
+    private:
+        std::shared_ptr<ControlConnection> makeControlConnection();
+
+        std::filesystem::path _ftpRoot;
+        std::shared_ptr<FileSystemProxy> _fileSystem;
+        bool _reusePort;
+        unsigned _readAhead;
+        std::uint64_t _directIoThreshold;
+        std::shared_ptr<ListingCache> _listingCache;
+    };
+
     class Server: public ConnectionBase {
     public:
-        //constructs the server, making it dispatch some path (by default, the current path) with given thread count.
-        Server(sockaddr_in localAddress, const std::filesystem::path &ftpRootPath = std::filesystem::current_path(), int threadCount = std::thread::hardware_concurrency()):
-                ConnectionBase(0,
-                               localAddress,
-                               std::make_shared<AsyncUring>(1ULL << 12)
-                                  ),
-                _ftpRoot(ftpRootPath),
-                _fileSystem(std::make_shared<FileSystemProxy>(ftpRootPath)),
-                _threadPool(threadCount)
-        {
-            if(!std::filesystem::exists(ftpRootPath))
-                throw std::runtime_error("Specified path does not exist");
-            _threadPool.executor().post([this](){
-                while(_fd > -1) {
-                    _threadPool.executor().post( _ring->check_act(), std::allocator<void>());
-                }
-            }, std::allocator<void>());
-        }
+        //constructs the server, making it dispatch some path (by default, the current path).
+        explicit Server(sockaddr_in localAddress, const std::filesystem::path &ftpRootPath = std::filesystem::current_path(), ServerOptions options = {});
 
         //starts the server in current thread and locking it.
-        void start() override {
-            do {
-                _fd = socket(AF_INET, SOCK_STREAM, 0);
-            } while (_fd == -1);
-            if (bind(_fd, reinterpret_cast<sockaddr *>(&_localAddr), sizeof(_localAddr)))
-                throw std::system_error(errno, std::system_category());
-            listen(_fd, 20);
-            enqueueConnection(_fd,
-                              std::make_shared<ControlConnection>(
-                                      this,
-                                      std::move(_ftpRoot),
-                                      std::move(_fileSystem)
-                              )
-            );
-        };
+        void start() override;
 
         //Server can be stopped by either call of the inherited stop() method or destruction.
 
         void stop() override {
+            _running = false;
             ConnectionBase::stop();
             _threadPool.stop();
         }
 
         void startActing() override {};
 
+        [[nodiscard]] const std::shared_ptr<FileSystemProxy>& fileSystem() const noexcept { return _fileSystem; }
+
+        //SQEs queued by the connections before the ring is forced to submit them outside the event loop turn.
+        static constexpr unsigned submitBatch = 32;
+        //Upper bound for a single completion wait, i.e. for how long the loop may take to notice the server stop.
+        static constexpr std::chrono::milliseconds completionWaitTimeout{100};
+
     private:
 
+        //Makes the event loop ring of the given shard.
+        static std::shared_ptr<AsyncUring> makeRing(const ServerOptions& options, std::size_t shard);
+        //Binds the calling event loop thread of the given shard to its CPU, if there is one configured.
+        void pinEventLoop(std::size_t shard) const;
+
+        void registerBufferPools();
+        //Pairs every ring with an IOPOLL ring for the large-file mode and starts polling them.
+        void startFileRings();
+
         boost::asio::thread_pool _threadPool;
         std::filesystem::path _ftpRoot;
         std::shared_ptr<FileSystemProxy> _fileSystem;
+        //Shared by all the rings, nullptr if inotify is unavailable.
+        std::shared_ptr<ListingCache> _listingCache;
+        ServerOptions _options;
+        //One ring per event loop. In the shared mode the only ring is the server's own _ring.
+        std::vector<std::shared_ptr<AsyncUring>> _rings;
+        std::atomic<bool> _running;
+        //The loops of the IOPOLL rings, which poll the device rather than sleep and so get threads of their own.
+        std::vector<std::jthread> _filePollers;
     };
 
 }
@@ -0,0 +1,125 @@
+#ifndef URING_TCP_SERVER_TASK_H
+#define URING_TCP_SERVER_TASK_H
+
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace ftp {
+
+    /**
+     * FramePool - recycles the coroutine frames of a single connection. A connection keeps running the same few
+     * coroutines, so the frames come in a handful of sizes and a freed frame is reused by the next one of its size.
+     */
+    class FramePool {
+    public:
+        void* allocate(std::size_t size) {
+            {
+                auto lk = std::lock_guard(_mutex);
+                for(auto& [blockSize, blocks]: _free)
+                    if(blockSize == size && !blocks.empty()) {
+                        void* block = blocks.back();
+                        blocks.pop_back();
+                        return block;
+                    }
+            }
+            return ::operator new(size);
+        }
+
+        void deallocate(void* block, std::size_t size) {
+            auto lk = std::lock_guard(_mutex);
+            for(auto& [blockSize, blocks]: _free)
+                if(blockSize == size) {
+                    blocks.push_back(block);
+                    return;
+                }
+            _free.emplace_back(size, std::vector<void*>{block});
+        }
+
+        FramePool() = default;
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+
+        ~FramePool() {
+            for(auto& [blockSize, blocks]: _free)
+                for(void* block: blocks)
+                    ::operator delete(block);
+        }
+
+    private:
+        std::mutex _mutex;
+        std::vector<std::pair<std::size_t, std::vector<void*>>> _free;
+    };
+
+    /**
+     * Task - a fire-and-forget coroutine: it starts running right away and frees itself once it returns.
+     * A member coroutine of a class exposing framePool() (e.g. a connection) takes its frame from that pool, which
+     * the frame keeps alive, so the coroutine may safely outlive its owner for the last steps.
+     * Nobody waits for a Task, so an exception escaping it ends the program, as one escaping a std::thread does.
+     * The frame is handed back to its pool first either way.
+     */
+    class Task {
+    public:
+        struct promise_type {
+            struct FinalAwaiter {
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle<promise_type> coroutine) noexcept {
+                    std::exception_ptr failure = std::move(coroutine.promise()._failure);
+                    coroutine.destroy();
+                    if(failure)
+                        //Leaves the noexcept function, i.e. std::terminate() with the exception for the report.
+                        std::rethrow_exception(std::move(failure));
+                }
+                void await_resume() const noexcept {}
+            };
+
+            Task get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { _failure = std::current_exception(); }
+
+            template<typename Owner, typename... Args>
+            requires requires(Owner& owner) { { owner.framePool() } -> std::convertible_to<std::shared_ptr<FramePool>>; }
+            static void* operator new(std::size_t size, Owner& owner, Args&...) {
+                std::shared_ptr<FramePool> pool = owner.framePool();
+                void* block = pool->allocate(size + headerSize);
+                ::new(block) std::shared_ptr<FramePool>(std::move(pool));
+                return static_cast<std::byte*>(block) + headerSize;
+            }
+
+            static void* operator new(std::size_t size) {
+                void* block = ::operator new(size + headerSize);
+                ::new(block) std::shared_ptr<FramePool>();
+                return static_cast<std::byte*>(block) + headerSize;
+            }
+
+            static void operator delete(void* frame, std::size_t size) noexcept {
+                void* block = static_cast<std::byte*>(frame) - headerSize;
+                auto* header = static_cast<std::shared_ptr<FramePool>*>(block);
+                auto pool = std::move(*header);
+                header->~shared_ptr();
+                if(pool)
+                    pool->deallocate(block, size + headerSize);
+                else
+                    ::operator delete(block);
+            }
+
+        private:
+            std::exception_ptr _failure;
+            //Keeps the frame aligned as the default operator new would.
+            static constexpr std::size_t headerSize =
+                    (sizeof(std::shared_ptr<FramePool>) + __STDCPP_DEFAULT_NEW_ALIGNMENT__ - 1) /
+                    __STDCPP_DEFAULT_NEW_ALIGNMENT__ * __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+        };
+    };
+
+}
+
+#endif //URING_TCP_SERVER_TASK_H
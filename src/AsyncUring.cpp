@@ -3,63 +3,89 @@
 //
 
 #include <AsyncUring.h>
+#include <array>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
 namespace ftp{
-    void AsyncUring::async_read_some(int fd, std::shared_ptr<std::string> &&data, Callback cb, int offset) {
+
+    void AsyncUring::async_read_some(int fd, std::shared_ptr<std::string> &&data, Callback cb, std::uint64_t offset) {
         static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
         async_read_some(fd, std::span<std::byte>({reinterpret_cast<std::byte *>(data->data()), data->size()}),
                         std::move(data), std::move(cb), offset);
     }
     
     void AsyncUring::async_read_some(int fd, std::span<std::byte> data, std::shared_ptr<std::string> &&dataToKeep,
-                                     Callback cb, int offset) {
+                                     Callback cb, std::uint64_t offset) {
         auto lk = std::lock_guard(_taskPostMutex);
-        io_uring_sqe *task = io_uring_get_sqe(&ring);
+        io_uring_sqe *task = acquire_sqe();
         io_uring_prep_read(task, fd, data.data(), data.size(), offset);
-        auto i_callback = new intrusive_callback(std::move(cb), std::move(dataToKeep));
-        io_uring_sqe_set_data(task, i_callback);
-        int res = io_uring_submit(&ring);
-        if (res < 0) {
-            delete i_callback;
-            throw std::system_error(errno, std::system_category(), "post_readv()");
-        }
-        active_callbacks.push_back(*i_callback);
+        //Copied rather than moved: the callers keep using the buffer through their own pointer.
+        enqueue(task, std::move(cb), std::shared_ptr<void>(dataToKeep), data.size());
     }
     
-    void AsyncUring::async_write_some(int fd, std::shared_ptr<std::string> &&data, Callback cb, int offset) {
+    void AsyncUring::async_write_some(int fd, std::shared_ptr<std::string> &&data, Callback cb, std::uint64_t offset) {
         static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
         async_write_some(fd, std::span<const std::byte>({reinterpret_cast<const std::byte *>(data->data()), data->size()}),
-                         std::move(data), cb, offset);
+                         std::move(data), std::move(cb), offset);
     }
     
     void
     AsyncUring::async_write_some(int fd, std::span<const std::byte> data, std::shared_ptr<std::string> &&dataToKeep,
-                                 Callback cb, int offset) {
+                                 Callback cb, std::uint64_t offset) {
         auto lk = std::lock_guard(_taskPostMutex);
-        io_uring_sqe *task = io_uring_get_sqe(&ring);
+        io_uring_sqe *task = acquire_sqe();
         io_uring_prep_write(task, fd, data.data(), data.size(), offset);
-        auto i_callback = new intrusive_callback(std::move(cb), std::move(dataToKeep));
-        io_uring_sqe_set_data(task, i_callback);
-        int res = io_uring_submit(&ring);
-        if (res < 0) {
-            delete i_callback;
-            throw std::system_error(errno, std::system_category(), "post_readv()");
-        }
-        active_callbacks.push_back(*i_callback);
+        enqueue(task, std::move(cb), std::shared_ptr<void>(dataToKeep), data.size());
     }
     
+    void AsyncUring::async_read_fixed(int fd, std::span<std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer,
+                                      Callback cb, std::uint64_t offset) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_read_fixed(task, fd, data.data(), data.size(), offset, buffer->index());
+        enqueue(task, std::move(cb), std::move(buffer), data.size());
+    }
+
+    void AsyncUring::async_write_fixed(int fd, std::span<const std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer,
+                                       Callback cb, std::uint64_t offset) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_write_fixed(task, fd, data.data(), data.size(), offset, buffer->index());
+        enqueue(task, std::move(cb), std::move(buffer), data.size());
+    }
+
+    void AsyncUring::async_send_zc(int fd, std::shared_ptr<std::string> &&data, Callback cb) {
+        static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
+        async_send_zc(fd, std::span<const std::byte>({reinterpret_cast<const std::byte *>(data->data()), data->size()}),
+                      std::move(data), std::move(cb));
+    }
+
+    void AsyncUring::async_send_zc(int fd, std::span<const std::byte> data, std::shared_ptr<std::string> &&dataToKeep,
+                                   Callback cb) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        //MSG_WAITALL makes the kernel retry short sends instead of reporting them back.
+        io_uring_prep_send_zc(task, fd, data.data(), data.size(), MSG_WAITALL, 0);
+        enqueue(task, std::move(cb), std::shared_ptr<void>(dataToKeep), data.size());
+    }
+
     void
     AsyncUring::async_read(int fd, std::shared_ptr<std::string> &&data, std::size_t len, Callback cb,
-                           int offset) {
+                           std::uint64_t offset) {
         static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
         if (len > 0) { //This means we still need to read something
             async_read_some(fd, {reinterpret_cast<std::byte *>(data->data() + data->size() - len),
                                  static_cast<unsigned long>(len)}, std::move(data),
-                            [fd, data, offset, this, len, cb](int res) mutable {
+                            [fd, data, offset, this, len, cb = std::move(cb)](int res) mutable {
                                 if (res < 0) {//something bad
                                     cb(res);
                                 } else { //successfully read some data, probably still have something to read
-                                    async_read(fd, std::move(data), len - res, cb, offset + res); //continue reading data
+                                    async_read(fd, std::move(data), len - res, std::move(cb), offset + res); //continue reading data
                                 }
                             }, offset);
         } else //read is complete
@@ -67,16 +93,16 @@ namespace ftp{
     }
     
     void AsyncUring::async_write(int fd, std::shared_ptr<std::string> &&data, std::size_t len, Callback cb,
-                                 int offset) {
+                                 std::uint64_t offset) {
         static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
         if (len > 0) { //This means we still need to write something
             async_write_some(fd, {reinterpret_cast<const std::byte *>(data->data() + data->size() - len),
                                   static_cast<unsigned long>(len)}, std::move(data),
-                             [fd, data, offset, this, len, cb](int res) mutable {
+                             [fd, data, offset, this, len, cb = std::move(cb)](int res) mutable {
                                  if (res < 0) {//something bad
                                      cb(res);
                                  } else { //successfully read some data, probably still have something to read
-                                     async_write(std::move(fd), std::move(data), len - res, cb, offset + res); //continue reading data
+                                     async_write(std::move(fd), std::move(data), len - res, std::move(cb), offset + res); //continue reading data
                                  }
                              }, offset);
         } else //read is complete
@@ -84,18 +110,18 @@ namespace ftp{
     }
     
     void AsyncUring::async_read_until(int fd, std::shared_ptr<std::string> &&data, const std::string &delim,
-                                      Callback cb, int offset) {
+                                      Callback cb, std::uint64_t offset) {
         async_read_until(fd, std::move(data), [delim](const std::string &d) {
             auto res = std::search(d.begin(), d.end(), std::default_searcher(delim.begin(), delim.end()));
             if (res == d.end())
                 return ptrdiff_t(-1);
             else return res - d.begin() + 1;
-        }, cb, offset);
+        }, std::move(cb), offset);
     }
     
     void
     AsyncUring::async_read_until(int fd, std::shared_ptr<std::string> &&data, Predicate pred, Callback cb,
-                                 int offset) {
+                                 std::uint64_t offset) {
         static_assert(sizeof(decltype(*data->data())) == 1, "Buffer must have byte-sized elements.");
         if (std::ptrdiff_t match_len = pred(*data); match_len > 0) {
             //if already got match, call back.
@@ -111,58 +137,626 @@ namespace ftp{
         std::size_t len = std::min(data->max_size(), data->capacity()) - data->size();
         data->resize(data->size() + len);
         async_read_some(fd, {reinterpret_cast<std::byte *>(data->data() + data->size() - len), len}, std::move(data),
-                        [fd, data, offset, this, pred, cb, len](int res) mutable {
+                        [fd, data, offset, this, pred = std::move(pred), cb = std::move(cb), len](int res) mutable {
                             data->resize(data->size() - len + res);
                             if (res < 0)
                                 cb(res);
                             else
-                                async_read_until(fd, std::move(data), pred, cb, offset + res);
+                                async_read_until(fd, std::move(data), std::move(pred), std::move(cb), offset + res);
                         }, offset);
     }
     
     void AsyncUring::async_sock_accept(int fd, sockaddr *addr, socklen_t *len, int flags, Callback cb) {
         auto lk = std::lock_guard(_taskPostMutex);
-        io_uring_sqe *task = io_uring_get_sqe(&ring);
+        io_uring_sqe *task = acquire_sqe();
         io_uring_prep_accept(task, fd, addr, len, flags);
-        auto *i_callback = new intrusive_callback(std::move(cb), std::shared_ptr<std::string>());
-        io_uring_sqe_set_data(task, i_callback);
-        int res = io_uring_submit(&ring);
-        if (res < 0) {
-            delete i_callback;
-            throw std::system_error(errno, std::system_category(), "post_accept()");
-        }
-        active_callbacks.push_back(*i_callback);
+        enqueue(task, std::move(cb), std::shared_ptr<std::string>(), 0);
     }
     
     void AsyncUring::async_sock_connect(int fd, sockaddr *addr, socklen_t len, Callback cb) {
         auto lk = std::lock_guard(_taskPostMutex);
-        io_uring_sqe *task = io_uring_get_sqe(&ring);
+        io_uring_sqe *task = acquire_sqe();
         io_uring_prep_connect(task, fd, addr, len);
-        auto *i_callback = new intrusive_callback(std::move(cb), std::shared_ptr<std::string>());
-        io_uring_sqe_set_data(task, i_callback);
-        int res = io_uring_submit(&ring);
-        if (res < 0) {
-            delete i_callback;
-            throw std::system_error(errno, std::system_category(), "post_connect()");
-        }
-        active_callbacks.push_back(*i_callback);
+        enqueue(task, std::move(cb), std::shared_ptr<std::string>(), 0);
     }
     
-    std::function<void(void)> AsyncUring::check_act() {
-        io_uring_cqe *result = nullptr;
-        io_uring_peek_cqe(&ring, &result);
-        if (result) {
-            auto lk = std::lock_guard(_taskPostMutex);
-            auto *i_callback = reinterpret_cast<intrusive_callback *>(io_uring_cqe_get_data(result));
-            Callback cb = i_callback->cb_;
-            int callRes = result->res;
-            std::function<void(void)> res = [cb, callRes]() { cb(callRes); };
-            active_callbacks.erase_and_dispose(active_callbacks.iterator_to(*i_callback),
-                                               std::default_delete<intrusive_callback>());
-            io_uring_cqe_seen(&ring, result);
+    void AsyncUring::async_statx(int dirfd, const char *path, int flags, unsigned mask, struct statx *buf,
+                                 Callback cb) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_statx(task, dirfd, path, flags, mask, buf);
+        enqueue(task, std::move(cb), std::shared_ptr<void>(), 0);
+    }
+
+    void AsyncUring::async_statx(int dirfd, std::filesystem::path path, int flags, unsigned mask,
+                                 std::shared_ptr<struct statx> buf, Callback cb) {
+        if (!supports(IORING_OP_STATX)) {
+            cb(::statx(dirfd, path.c_str(), flags, mask, buf.get()) ? -errno : 0);
+            return;
+        }
+        auto keep = std::make_shared<std::pair<std::filesystem::path, std::shared_ptr<struct statx>>>(
+                std::move(path), std::move(buf));
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_statx(task, dirfd, keep->first.c_str(), flags, mask, keep->second.get());
+        enqueue(task, std::move(cb), std::move(keep), 0);
+    }
+
+    void AsyncUring::async_openat(int dirfd, std::filesystem::path path, int flags, mode_t mode, Callback cb) {
+        if (!supports(IORING_OP_OPENAT)) {
+            int fd = ::openat(dirfd, path.c_str(), flags, mode);
+            cb(fd < 0 ? -errno : fd);
+            return;
+        }
+        auto keep = std::make_shared<std::filesystem::path>(std::move(path));
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_openat(task, dirfd, keep->c_str(), flags, mode);
+        enqueue(task, std::move(cb), std::move(keep), 0);
+    }
+
+    void AsyncUring::async_close(int fd, Callback cb) {
+        if (!supports(IORING_OP_CLOSE)) {
+            cb(::close(fd) ? -errno : 0);
+            return;
+        }
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_close(task, fd);
+        enqueue(task, std::move(cb), std::shared_ptr<void>(), 0);
+    }
+
+    void AsyncUring::async_unlinkat(int dirfd, std::filesystem::path path, int flags, Callback cb) {
+        if (!supports(IORING_OP_UNLINKAT)) {
+            cb(::unlinkat(dirfd, path.c_str(), flags) ? -errno : 0);
+            return;
+        }
+        auto keep = std::make_shared<std::filesystem::path>(std::move(path));
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_unlinkat(task, dirfd, keep->c_str(), flags);
+        enqueue(task, std::move(cb), std::move(keep), 0);
+    }
+
+    void AsyncUring::async_mkdirat(int dirfd, std::filesystem::path path, mode_t mode, Callback cb) {
+        if (!supports(IORING_OP_MKDIRAT)) {
+            cb(::mkdirat(dirfd, path.c_str(), mode) ? -errno : 0);
+            return;
+        }
+        auto keep = std::make_shared<std::filesystem::path>(std::move(path));
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_mkdirat(task, dirfd, keep->c_str(), mode);
+        enqueue(task, std::move(cb), std::move(keep), 0);
+    }
+
+    void AsyncUring::async_nop(Callback cb) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_nop(task);
+        enqueue(task, std::move(cb), std::shared_ptr<void>(), 0);
+    }
+
+    void AsyncUring::async_splice(int fdIn, std::int64_t offIn, int fdOut, std::int64_t offOut, std::size_t len,
+                                  Callback cb) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_splice(task, fdIn, offIn, fdOut, offOut, len, 0);
+        enqueue(task, std::move(cb), std::shared_ptr<std::string>(), len);
+    }
+
+    void AsyncUring::async_splice_through(int fdIn, std::int64_t offIn, const std::array<int, 2> &pipe, int fdOut,
+                                          std::size_t len, LinkedCallback cb) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        reserve_sqes(2);
+        io_uring_sqe *fill = acquire_sqe();
+        io_uring_prep_splice(fill, fdIn, offIn, pipe[1], -1, len, 0);
+        io_uring_sqe *drain = acquire_sqe();
+        io_uring_prep_splice(drain, pipe[0], -1, fdOut, -1, len, 0);
+        enqueue_pair(fill, drain, std::move(cb), std::shared_ptr<void>(), std::int64_t(len), len);
+    }
+
+    void AsyncUring::async_read_write_fixed(int fdIn, std::uint64_t inOffset, int fdOut, std::uint64_t outOffset,
+                                            std::span<std::byte> data, std::shared_ptr<BufferPool::Buffer> buffer,
+                                            LinkedCallback cb, bool fromSocket) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        reserve_sqes(2);
+        io_uring_sqe *read = acquire_sqe();
+        if (fromSocket)
+            io_uring_prep_recv(read, fdIn, data.data(), data.size(), MSG_WAITALL);
+        else
+            io_uring_prep_read_fixed(read, fdIn, data.data(), data.size(), inOffset, buffer->index());
+        io_uring_sqe *write = acquire_sqe();
+        io_uring_prep_write_fixed(write, fdOut, data.data(), data.size(), outOffset, buffer->index());
+        enqueue_pair(read, write, std::move(cb), std::move(buffer), std::int64_t(data.size()), data.size());
+    }
+
+    int AsyncUring::init_ring(unsigned size, UringMode mode, SqThread sqThread, bool singleIssuer) {
+        //Tried in turn until the kernel takes one: SINGLE_ISSUER and DEFER_TASKRUN came in 6.1, COOP_TASKRUN in 5.19.
+        //The task work flags make no sense to the polling rings, which the kernel refuses them for anyway.
+        std::vector<unsigned> setups;
+        if (mode == UringMode::interrupted) {
+            if (singleIssuer) {
+                setups.push_back(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+                setups.push_back(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG);
+            }
+            setups.push_back(IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG);
+        }
+        setups.push_back(0);
+        int res = -EINVAL;
+        for (unsigned setup: setups) {
+            io_uring_params params{};
+            params.flags = unsigned(mode) | setup;
+            //A single issuer ring starts disabled, so that the thread enabling it becomes the issuer.
+            if (setup & IORING_SETUP_SINGLE_ISSUER)
+                params.flags |= IORING_SETUP_R_DISABLED;
+            if (mode == UringMode::sq_polled) {
+                if (sqThread.cpu >= 0) {
+                    params.flags |= IORING_SETUP_SQ_AFF;
+                    params.sq_thread_cpu = unsigned(sqThread.cpu);
+                }
+                params.sq_thread_idle = unsigned(sqThread.idle.count());
+            }
+            res = io_uring_queue_init_params(size, &ring, &params);
+            if (res == -EINVAL)
+                continue;
+            if (res < 0)
+                return res;
+            _setupFlags = params.flags & ~IORING_SETUP_R_DISABLED;
+            break;
+        }
+        //A batching ring is woken up as well when the SQEs left behind by the other threads are not to wait for
+        //the next completion or the timeout of the loop.
+        if (res < 0 || (!(_setupFlags & IORING_SETUP_SINGLE_ISSUER) && _submitBatch == 1))
             return res;
+        _wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (_wakeFd < 0) {
+            res = -errno;
+            io_uring_queue_exit(&ring);
+        }
+        return res;
+    }
+
+    std::string AsyncUring::setup_description() const {
+        std::string description;
+        auto add = [&](unsigned flag, const char *name) {
+            if (_setupFlags & flag)
+                description.append(description.empty() ? "" : ", ").append(name);
+        };
+        add(IORING_SETUP_SQPOLL, "SQ polling");
+        add(IORING_SETUP_IOPOLL, "IO polling");
+        add(IORING_SETUP_SINGLE_ISSUER, "single issuer");
+        add(IORING_SETUP_DEFER_TASKRUN, "deferred task work");
+        add(IORING_SETUP_COOP_TASKRUN, "cooperative task work");
+        return description.empty() ? std::string("interrupted") : description;
+    }
+
+    void AsyncUring::adopt_loop_thread() {
+        auto lk = std::lock_guard(_taskPostMutex);
+        if (_setupFlags & IORING_SETUP_SINGLE_ISSUER) {
+            int res = io_uring_enable_rings(&ring);
+            if (res < 0)
+                throw std::system_error(-res, std::system_category(), "adopt_loop_thread()");
+        }
+        _loopThread = std::this_thread::get_id();
+        arm_wake();
+    }
+
+    void AsyncUring::wake_loop() {
+        //Before there is a loop thread, its first wait_act() submits everything.
+        if (_wakePending || _loopThread == std::thread::id())
+            return;
+        _wakePending = true;
+        eventfd_write(_wakeFd, 1);
+    }
+
+    void AsyncUring::arm_wake() {
+        io_uring_sqe *task = acquire_sqe();
+        io_uring_prep_poll_add(task, _wakeFd, POLLIN);
+        io_uring_sqe_set_data64(task, wakeEvent);
+    }
+
+    std::size_t AsyncUring::wait_act(std::chrono::milliseconds timeout, const Dispatcher &dispatch) {
+        if (_wakeFd >= 0 && _loopThread == std::thread::id())
+            adopt_loop_thread();
+        if (_polled) {
+            //Waiting on a polled ring spins instead of sleeping, which is only worth it while the device has work.
+            auto lk = std::unique_lock(_taskPostMutex);
+            if (!_operationPosted.wait_for(lk, timeout, [this]{ return _inFlight > 0; }))
+                return 0;
+        }
+        flush();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        __kernel_timespec ts{
+                .tv_sec = seconds.count(),
+                .tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout - seconds).count()
+        };
+        io_uring_cqe *result = nullptr;
+        int res;
+        if (ring.features & IORING_FEAT_EXT_ARG)
+            res = io_uring_wait_cqe_timeout(&ring, &result, &ts);
+        else {
+            //Older kernels implement the timeout with an extra SQE. It is queued under the lock like any other, the
+            //wait itself runs unlocked so that the other threads keep posting meanwhile.
+            {
+                auto lk = std::lock_guard(_taskPostMutex);
+                io_uring_sqe *task = acquire_sqe();
+                io_uring_prep_timeout(task, &ts, 1, 0);
+                io_uring_sqe_set_data64(task, LIBURING_UDATA_TIMEOUT);
+                submit_pending();
+            }
+            res = io_uring_wait_cqe(&ring, &result);
+        }
+        if (res < 0 && res != -ETIME && res != -EINTR && res != -EAGAIN)
+            throw std::system_error(-res, std::system_category(), "wait_act()");
+
+        std::array<io_uring_cqe *, reapBatch> cqes{};
+        std::array<Completion, reapBatch> completions;
+        std::size_t reaped = 0;
+        while (unsigned count = io_uring_peek_batch_cqe(&ring, cqes.data(), cqes.size())) {
+            unsigned ready = 0;
+            {
+                auto lk = std::lock_guard(_taskPostMutex);
+                for (unsigned i = 0; i < count; i++) {
+                    if (io_uring_cqe_get_data64(cqes[i]) == LIBURING_UDATA_TIMEOUT)
+                        //The timeout of an earlier wait on a kernel without IORING_FEAT_EXT_ARG.
+                        continue;
+                    if (io_uring_cqe_get_data64(cqes[i]) == wakeEvent) {
+                        //Somebody has left SQEs behind, they get submitted as the loop comes around.
+                        eventfd_t value;
+                        eventfd_read(_wakeFd, &value);
+                        _wakePending = false;
+                        arm_wake();
+                        continue;
+                    }
+                    auto index = static_cast<std::uint32_t>(io_uring_cqe_get_data64(cqes[i]));
+                    if (auto completion = complete(index, cqes[i]))
+                        completions[ready++] = std::move(completion);
+                }
+                io_uring_cq_advance(&ring, count);
+            }
+            //Callbacks are dispatched unlocked, since they are free to post new operations right away.
+            for (unsigned i = 0; i < ready; i++)
+                dispatch(std::move(completions[i]));
+            reaped += count;
+        }
+        return reaped;
+    }
+
+    bool AsyncUring::register_buffer_pool(std::shared_ptr<BufferPool> pool) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        assert(!_bufferPool);
+        const auto &iovecs = pool->iovecs();
+        if (io_uring_register_buffers(&ring, iovecs.data(), iovecs.size()) < 0)
+            return false;
+        _bufferPool = std::move(pool);
+        return true;
+    }
+
+    Completion AsyncUring::complete(std::uint32_t index, const io_uring_cqe *cqe) {
+        auto &operation = op(index);
+        int callRes = cqe->res;
+        if (operation.multishot_ != operation::multishot::none) {
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                auto bufferId = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if (callRes > 0) {
+                    //Copied out in the CQ order, so the consumers see the stream intact whichever thread runs them.
+                    auto queue = std::static_pointer_cast<RecvQueue>(operation.i_data_);
+                    auto lk = std::lock_guard(queue->mutex);
+                    queue->data.append(reinterpret_cast<const char *>(_providedBuffers.memory.get()) +
+                                       std::size_t(bufferId) * _providedBuffers.size, callRes);
+                }
+                recycle_provided(bufferId);
+            }
+            auto &cb = std::get<std::shared_ptr<Callback>>(operation.cb_);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                bool accepting = operation.multishot_ == operation::multishot::accept;
+                if (callRes > 0 || callRes == -ENOBUFS || (accepting && callRes == 0)) {
+                    //The kernel ended the multishot (e.g. the buffer ring ran dry) - keep the same operation going.
+                    io_uring_sqe *task = acquire_sqe();
+                    if (accepting)
+                        io_uring_prep_multishot_accept(task, operation.fd_, nullptr, nullptr, 0);
+                    else
+                        prep_recv_multishot(task, operation.fd_);
+                    apply_fixed_files(task);
+                    io_uring_sqe_set_data64(task, index);
+                } else {
+                    auto last = std::move(cb);
+                    release_operation(index);
+                    return [cb = std::move(last), callRes]() { (*cb)(callRes); };
+                }
+            }
+            if (callRes == -ENOBUFS)
+                return {};
+            //Shared rather than copied, as the deliveries may run concurrently and outlive the operation.
+            return [cb, callRes]() { (*cb)(callRes); };
+        }
+
+        if (operation.linked_ != noOperation) {
+            bool tail = std::holds_alternative<LinkedCallback>(operation.cb_);
+            std::uint32_t tailIndex = tail ? index : operation.linked_;
+            auto &pair = op(tailIndex);
+            pair.results_[tail ? 1 : 0] = callRes;
+            if (--pair.pending_ > 0)
+                return {};
+            auto cb = std::move(std::get<LinkedCallback>(pair.cb_));
+            auto results = pair.results_;
+            release_operation(pair.linked_);
+            release_operation(tailIndex);
+            return [cb = std::move(cb), results]() mutable { cb(results[0], results[1]); };
+        }
+
+        Completion completion;
+        //Zero-copy sends complete twice: the result carries F_MORE, the final F_NOTIF releases the buffer.
+        if (!(cqe->flags & IORING_CQE_F_NOTIF))
+            completion = [cb = std::move(std::get<Callback>(operation.cb_)), callRes]() mutable { cb(callRes); };
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            release_operation(index);
+        return completion;
+    }
+
+    void AsyncUring::async_recv_multishot(int fd, std::shared_ptr<RecvQueue> queue, Callback cb) {
+        assert(has_provided_buffers());
+        arm_multishot(operation::multishot::recv, fd, std::move(cb), std::move(queue));
+    }
+
+    void AsyncUring::async_sock_accept_multishot(int fd, Callback cb) {
+        arm_multishot(operation::multishot::accept, fd, std::move(cb), std::shared_ptr<void>());
+    }
+
+    void AsyncUring::arm_multishot(operation::multishot kind, int fd, Callback &&cb,
+                                   std::shared_ptr<void> &&dataToKeep) {
+        //Allocated once per arming, every delivery only takes another reference.
+        auto shared = std::make_shared<Callback>(std::move(cb));
+        auto lk = std::lock_guard(_taskPostMutex);
+        io_uring_sqe *task = acquire_sqe();
+        if (kind == operation::multishot::accept)
+            io_uring_prep_multishot_accept(task, fd, nullptr, nullptr, 0);
+        else
+            prep_recv_multishot(task, fd);
+        auto &operation = op(enqueue(task, nullptr, std::move(dataToKeep), 0));
+        //The reaper cannot see the operation before we unlock.
+        operation.cb_ = std::move(shared);
+        operation.multishot_ = kind;
+        operation.fd_ = fd;
+    }
+
+    void AsyncUring::prep_recv_multishot(io_uring_sqe *task, int fd) {
+        io_uring_prep_recv_multishot(task, fd, nullptr, 0, 0);
+        task->flags |= IOSQE_BUFFER_SELECT;
+        task->buf_group = providedBufferGroup;
+    }
+
+    bool AsyncUring::register_provided_buffers(unsigned count, std::size_t size) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        assert(!_providedBuffers.ring);
+        int res = 0;
+        io_uring_buf_ring *bufferRing = io_uring_setup_buf_ring(&ring, count, providedBufferGroup, 0, &res);
+        if (!bufferRing)
+            return false;
+        _providedBuffers.ring = bufferRing;
+        _providedBuffers.memory = std::make_unique<std::byte[]>(count * size);
+        _providedBuffers.count = count;
+        _providedBuffers.size = size;
+        for (unsigned i = 0; i < count; i++)
+            io_uring_buf_ring_add(bufferRing, _providedBuffers.memory.get() + i * size, size, i,
+                                  io_uring_buf_ring_mask(count), i);
+        io_uring_buf_ring_advance(bufferRing, count);
+        return true;
+    }
+
+    void AsyncUring::recycle_provided(unsigned short bufferId) {
+        io_uring_buf_ring_add(_providedBuffers.ring, _providedBuffers.memory.get() + bufferId * _providedBuffers.size,
+                              _providedBuffers.size, bufferId, io_uring_buf_ring_mask(_providedBuffers.count), 0);
+        io_uring_buf_ring_advance(_providedBuffers.ring, 1);
+    }
+
+    bool AsyncUring::enable_fixed_files(unsigned size) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        assert(_freeFixedSlots.empty());
+        if (io_uring_register_files_sparse(&ring, size) < 0)
+            return false;
+        for (unsigned slot = size; slot > 0; slot--)
+            _freeFixedSlots.push_back(slot - 1);
+        return true;
+    }
+
+    bool AsyncUring::register_file(int fd) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        if (fd < 0 || _freeFixedSlots.empty())
+            return false;
+        unsigned slot = _freeFixedSlots.back();
+        if (io_uring_register_files_update(&ring, slot, &fd, 1) < 0)
+            return false;
+        _freeFixedSlots.pop_back();
+        if (_fixedSlots.size() <= std::size_t(fd))
+            _fixedSlots.resize(fd + 1, -1);
+        _fixedSlots[fd] = int(slot);
+        return true;
+    }
+
+    void AsyncUring::unregister_file(int fd) {
+        auto lk = std::lock_guard(_taskPostMutex);
+        if (fd < 0 || _fixedSlots.size() <= std::size_t(fd) || _fixedSlots[fd] < 0)
+            return;
+        //The operations still in flight hold their own reference to the file.
+        int slot = std::exchange(_fixedSlots[fd], -1);
+        if (foreign_thread() && _loopThread != std::thread::id()) {
+            //The issuer is the only one allowed to register, so the update goes through the SQ. The slot is only
+            //reused once it is done, not to have the update clear the next file.
+            auto empty = std::make_shared<int>(-1);
+            io_uring_sqe *task = acquire_sqe();
+            io_uring_prep_files_update(task, empty.get(), 1, slot);
+            enqueue(task, [this, slot](std::int64_t) {
+                auto lk = std::lock_guard(_taskPostMutex);
+                _freeFixedSlots.push_back(unsigned(slot));
+            }, std::move(empty), 0);
+            return;
+        }
+        int empty = -1;
+        io_uring_register_files_update(&ring, slot, &empty, 1);
+        _freeFixedSlots.push_back(unsigned(slot));
+    }
+
+    void AsyncUring::apply_fixed_files(io_uring_sqe *task) {
+        auto slot = [this](int fd) {
+            return fd >= 0 && std::size_t(fd) < _fixedSlots.size() ? _fixedSlots[fd] : -1;
+        };
+        //A fixed slot is closed with IORING_OP_CLOSE's file_index instead, the plain close has to get the descriptor.
+        if (task->opcode == IORING_OP_CLOSE)
+            return;
+        if (int fixed = slot(task->fd); fixed >= 0) {
+            task->fd = fixed;
+            task->flags |= IOSQE_FIXED_FILE;
+        }
+        if (task->opcode == IORING_OP_SPLICE)
+            if (int fixed = slot(task->splice_fd_in); fixed >= 0) {
+                task->splice_fd_in = fixed;
+                task->splice_flags |= SPLICE_F_FD_IN_FIXED;
+            }
+    }
+
+    int AsyncUring::flush() {
+        auto lk = std::lock_guard(_taskPostMutex);
+        return submit_pending();
+    }
+
+    io_uring_sqe *AsyncUring::acquire_sqe() {
+        if (_overflow.empty() && !_overflowNext) {
+            io_uring_sqe *task = io_uring_get_sqe(&ring);
+            if (!task) {
+                //SQ is full of batched entries - push them to the kernel to free the slots.
+                submit_pending();
+                task = io_uring_get_sqe(&ring);
+            }
+            if (task)
+                return task;
+        }
+        //Only the loop may free the SQ of a single issuer ring. The SQE waits behind the ones queued before it.
+        if (_overflowNext)
+            _overflowNext--;
+        return &_overflow.emplace_back();
+    }
+
+    void AsyncUring::reserve_sqes(unsigned count) {
+        if (io_uring_sq_space_left(&ring) < count)
+            submit_pending();
+        if (io_uring_sq_space_left(&ring) < count)
+            //The chain goes to the overflow as a whole, as it must not be split by a submission.
+            _overflowNext = count;
+    }
+
+    bool AsyncUring::move_overflow() {
+        bool moved = false;
+        while (!_overflow.empty()) {
+            std::size_t chain = 1;
+            while (chain < _overflow.size() && (_overflow[chain - 1].flags & IOSQE_IO_LINK))
+                chain++;
+            if (io_uring_sq_space_left(&ring) < chain)
+                break;
+            for (std::size_t i = 0; i < chain; i++) {
+                *io_uring_get_sqe(&ring) = _overflow.front();
+                _overflow.pop_front();
+            }
+            moved = true;
+        }
+        return moved;
+    }
+
+    std::uint32_t AsyncUring::enqueue(io_uring_sqe *task, Callback &&cb, std::shared_ptr<void> &&dataToKeep,
+                                      std::size_t payload, bool linkNext) {
+        apply_fixed_files(task);
+        //The SQE is already in the SQ, so the callback has to be registered whether the submission succeeds or not.
+        std::uint32_t index = acquire_operation();
+        auto &operation = op(index);
+        operation.cb_.emplace<Callback>(std::move(cb));
+        operation.i_data_ = std::move(dataToKeep);
+        io_uring_sqe_set_data64(task, index);
+        _pendingBytes += payload;
+        if (linkNext)
+            return index;
+        if (io_uring_sq_ready(&ring) >= _submitBatch || _pendingBytes >= _submitBytes || !_overflow.empty())
+            submit_pending();
+        else if (_wakeFd >= 0 && _loopThread != std::this_thread::get_id())
+            //The loop may be asleep in wait_act() with nothing to wake it before the timeout.
+            wake_loop();
+        return index;
+    }
+
+    void AsyncUring::enqueue_pair(io_uring_sqe *head, io_uring_sqe *tail, LinkedCallback &&cb,
+                                  std::shared_ptr<void> &&dataToKeep, std::int64_t headLength, std::size_t payload) {
+        bool singleCqe = ring.features & IORING_FEAT_CQE_SKIP;
+        //Exactly one CQE per pair with the skip: the tail's if the head was complete, otherwise the head's, as
+        //a failed head suppresses the CQEs of the links it cancels.
+        io_uring_sqe_set_flags(head, IOSQE_IO_LINK | (singleCqe ? IOSQE_CQE_SKIP_SUCCESS : 0));
+        std::uint32_t headIndex = enqueue(head, nullptr, std::shared_ptr<void>(), 0, true);
+        std::uint32_t tailIndex = enqueue(tail, nullptr, std::move(dataToKeep), payload);
+        //The halves are released together, so the tail keeps the data for both.
+        auto &first = op(headIndex), &second = op(tailIndex);
+        first.cb_ = std::monostate();
+        first.linked_ = tailIndex;
+        second.cb_.emplace<LinkedCallback>(std::move(cb));
+        second.linked_ = headIndex;
+        second.pending_ = singleCqe ? 1 : 2;
+        second.results_ = {headLength, -ECANCELED};
+    }
+
+    std::uint32_t AsyncUring::acquire_operation() {
+        if (_freeOperations == noOperation) {
+            auto base = std::uint32_t(_operations.size()) * operationChunk;
+            auto &chunk = _operations.emplace_back(std::make_unique<operation[]>(operationChunk));
+            for (std::uint32_t i = operationChunk; i > 0; i--) {
+                chunk[i - 1].nextFree_ = _freeOperations;
+                _freeOperations = base + i - 1;
+            }
+        }
+        std::uint32_t index = _freeOperations;
+        _freeOperations = op(index).nextFree_;
+        if (_inFlight++ == 0 && _polled)
+            _operationPosted.notify_one();
+        return index;
+    }
+
+    void AsyncUring::release_operation(std::uint32_t index) {
+        auto &operation = op(index);
+        operation.i_data_.reset();
+        operation.cb_ = std::monostate();
+        operation.multishot_ = operation::multishot::none;
+        operation.pending_ = 0;
+        operation.fd_ = -1;
+        operation.linked_ = noOperation;
+        operation.nextFree_ = _freeOperations;
+        _freeOperations = index;
+        _inFlight--;
+    }
+
+    int AsyncUring::submit_pending() {
+        if (io_uring_sq_ready(&ring) == 0 && _overflow.empty())
+            return 0;
+        if (foreign_thread()) {
+            //Only the issuer may enter the ring.
+            wake_loop();
+            return 0;
+        }
+        int submitted = 0;
+        while (true) {
+            bool moved = move_overflow();
+            if (io_uring_sq_ready(&ring) == 0)
+                break;
+            int res = io_uring_submit(&ring);
+            if (res < 0) {
+                //Transient shortages leave the SQEs queued, they will be pushed by the next flush.
+                if (res == -EAGAIN || res == -EBUSY || res == -EINTR)
+                    return submitted;
+                throw std::system_error(-res, std::system_category(), "submit_pending()");
+            }
+            submitted += res;
+            //An SQ polling kernel thread may not have taken the entries yet, the rest waits for the next flush then.
+            if (_overflow.empty() || (!moved && res == 0))
+                break;
         }
-        return [](){};
+        _pendingBytes = 0;
+        return submitted;
     }
 
 }
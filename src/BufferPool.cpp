@@ -0,0 +1,46 @@
+#include <BufferPool.h>
+#include <system_error>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace ftp {
+
+    BufferPool::BufferPool(std::size_t count, std::size_t bufferSize) {
+        auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        _bufferSize = (bufferSize + pageSize - 1) / pageSize * pageSize;
+        _mappedSize = _bufferSize * count;
+        //A single anonymous mapping keeps every buffer page-aligned and lets the kernel pin them in one go.
+        void *memory = mmap(nullptr, _mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "BufferPool()");
+        _memory = static_cast<std::byte *>(memory);
+        _iovecs.reserve(count);
+        _freeBuffers.reserve(count);
+        for (std::size_t i = 0; i < count; i++) {
+            _iovecs.push_back({_memory + i * _bufferSize, _bufferSize});
+            _freeBuffers.push_back(static_cast<int>(count - i - 1));
+        }
+    }
+
+    std::shared_ptr<BufferPool::Buffer> BufferPool::acquire() {
+        int index;
+        {
+            auto lk = std::lock_guard(_poolMutex);
+            if (_freeBuffers.empty())
+                return nullptr;
+            index = _freeBuffers.back();
+            _freeBuffers.pop_back();
+        }
+        return std::make_shared<Buffer>(shared_from_this(), index);
+    }
+
+    void BufferPool::release(int index) {
+        auto lk = std::lock_guard(_poolMutex);
+        _freeBuffers.push_back(index);
+    }
+
+    BufferPool::~BufferPool() {
+        munmap(_memory, _mappedSize);
+    }
+
+}
@@ -11,6 +11,9 @@ namespace ftp {
                 //stop self
                 stop();
             } else {
+                _ring->register_file(_fd);
+                if (_parent)
+                    _parent->childAccepted(this);
                 //After all queue manipulations, we can finally start the protocol payload functioning.
                 startActing();
             }
@@ -31,6 +34,7 @@ namespace ftp {
             child->stop();
         }
         if (_fd >= 0) {
+            _ring->unregister_file(_fd);
             close(_fd);
             _fd = -1;
         }
@@ -49,13 +53,30 @@ namespace ftp {
         connection->start();
     }
 
+    void ConnectionBase::adoptConnection(int fd, std::shared_ptr<ConnectionBase> &&connection) {
+        socklen_t addrLen = sizeof(sockaddr_in);
+        getsockname(fd, reinterpret_cast<sockaddr *>(&(connection->_localAddr)), &addrLen);
+        connection->_addrLen = sizeof(connection->_remoteAddr);
+        getpeername(fd, reinterpret_cast<sockaddr *>(&(connection->_remoteAddr)), &(connection->_addrLen));
+        connection->_fd = fd;
+        connection->_ring->register_file(fd);
+        {
+            auto lk = std::lock_guard(_childConnectionsMutex);
+            _childConnections.push_back(connection);
+        }
+        connection->startActing();
+    }
+
     void ConnectionBase::acceptChildStop(ConnectionBase *child) {
         //Adding thread-safety
         auto lk = std::lock_guard(_childConnectionsMutex);
-        auto childPtr = *std::find_if(_childConnections.begin(), _childConnections.end(),
-                                      [child](const auto &el) { return el.get() == child; });
-        childPtr->_parent = nullptr;
-        std::erase(_childConnections, childPtr);
+        auto found = std::find_if(_childConnections.begin(), _childConnections.end(),
+                                  [child](const auto &el) { return el.get() == child; });
+        //The child may have been taken off the list by stop() of this connection meanwhile.
+        if (found == _childConnections.end())
+            return;
+        (*found)->_parent = nullptr;
+        _childConnections.erase(found);
     }
 
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <ConnectionState.h>
 #include <ControlConnection.h>
+#include <charconv>
 
 
 namespace ftp{
@@ -47,6 +48,22 @@ namespace ftp{
         );
     }
 
+    void ControlConnectionState::feat() const {
+        std::string features = "211-Features:\r\n"
+                               " MDTM\r\n"
+                               " MLST type*;size*;modify*;perm*;\r\n"
+                               " REST STREAM\r\n"
+                               " SIZE\r\n"
+                               "211 End\r\n"s;
+        std::size_t length = features.size();
+        _handledConnection->ring()->async_write(
+                _handledConnection->fd(),
+                std::make_shared<std::string>(std::move(features)),
+                length,
+                _handledConnection->defaultAsyncOpHandler
+        );
+    }
+
     void ControlConnectionState::quit() {
         _handledConnection->ring()->async_write(
                 _handledConnection->fd(),
@@ -99,10 +116,8 @@ namespace ftp{
     }
 
     void ControlConnectionStateLoggedIn::cwd(std::string path) {
-        std::filesystem::path fullPath;
         try {
             path = parsePath(_handledConnection->pwd(), path);
-            fullPath = _handledConnection->root()/path;
         } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
@@ -113,29 +128,31 @@ namespace ftp{
             return;
         }
 
-        if(!std::filesystem::exists(fullPath))
-            _handledConnection->ring()->async_write(
-                    _handledConnection->fd(),
-                    std::make_shared<std::string>("550 File does not exist\r\n"s),
-                    25,
-                    _handledConnection->defaultAsyncOpHandler
-            );
-        else if(!std::filesystem::is_directory(fullPath))
-            _handledConnection->ring()->async_write(
-                    _handledConnection->fd(),
-                    std::make_shared<std::string>("550 Specified path is not a directory\r\n"s),
-                    39,
-                    _handledConnection->defaultAsyncOpHandler
-            );
-        else {
-            _handledConnection->pwd() = path;
-            _handledConnection->ring()->async_write(
-                    _handledConnection->fd(),
-                    std::make_shared<std::string>("200 Directory changed\r\n"s),
-                    23,
-                    _handledConnection->defaultAsyncOpHandler
-            );
-        }
+        _handledConnection->statPath(path, [this, path](int res, std::uint16_t mode){
+            if(res < 0)
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("550 File does not exist\r\n"s),
+                        25,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+            else if(!S_ISDIR(mode))
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("550 Specified path is not a directory\r\n"s),
+                        39,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+            else {
+                _handledConnection->pwd() = path;
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("200 Directory changed\r\n"s),
+                        23,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+            }
+        });
     }
 
     void ControlConnectionStateLoggedIn::cdup() {
@@ -169,6 +186,8 @@ namespace ftp{
                 typeCode == std::string{static_cast<char>(RepresentationType::ASCII)}
                             + static_cast<char>(RepresentationType::NonPrint)) {
             _handledConnection->setRepresentationType(RepresentationType::ASCII);
+            //Restart markers are byte offsets of the stored file, which mean nothing to an ASCII transfer.
+            _handledConnection->setRestartOffset(0);
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
                     std::make_shared<std::string>("200 Type changed\r\n"s),
@@ -239,10 +258,9 @@ namespace ftp{
 
     void ControlConnectionStateLoggedIn::retr(std::filesystem::path path) {
         //Retrieve operation is allowed only on files.
-        std::string fullPath;
+        std::uint64_t restartOffset = _handledConnection->takeRestartOffset();
         try {
             path = parsePath(_handledConnection->pwd(), path);
-            fullPath = _handledConnection->root()/path;
         } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
@@ -253,44 +271,149 @@ namespace ftp{
             return;
         }
 
-        if(!std::filesystem::exists(fullPath))
+        _handledConnection->statPath(path, [this, path, restartOffset](int res, std::uint16_t mode) mutable {
+            if(res < 0)
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("501 File does not exist\r\n"s),
+                        25,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+            else if(S_ISDIR(mode))
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("501 Specified path is a directory\r\n"s),
+                        35,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+            else{
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("150 Opened data connection\r\n"s),
+                        28,
+                        [this, path, restartOffset](int res) mutable {
+                            _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::sender, [this](){
+                                _handledConnection->ring()->async_write(
+                                        _handledConnection->fd(),
+                                        std::make_shared<std::string>("250 Operation successful\r\n"),
+                                        26,
+                                        _handledConnection->defaultAsyncOpHandler
+                                );
+                            }, restartOffset);}
+                );
+            }
+        });
+    }
+
+    void ControlConnectionStateLoggedIn::stor(std::filesystem::path path) {
+        //Stor operation is allowed only on existing files.
+        std::uint64_t restartOffset = _handledConnection->takeRestartOffset();
+        try {
+            path = parsePath(_handledConnection->pwd(), path);
+        } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("501 File does not exist\r\n"s),
-                    25,
+                    std::make_shared<std::string>("501 Illegal path\r\n"s),
+                    18,
                     _handledConnection->defaultAsyncOpHandler
             );
-        else if(std::filesystem::is_directory(fullPath))
+            return;
+        }
+
+        auto store = [this, path, restartOffset]() mutable {
+            _handledConnection->statPath(path, [this, path, restartOffset](int res, std::uint16_t mode) mutable {
+                if(res < 0)
+                    _handledConnection->ring()->async_write(
+                            _handledConnection->fd(),
+                            std::make_shared<std::string>("501 File does not exist\r\n"s),
+                            25,
+                            _handledConnection->defaultAsyncOpHandler
+                    );
+                else if(S_ISDIR(mode))
+                    _handledConnection->ring()->async_write(
+                            _handledConnection->fd(),
+                            std::make_shared<std::string>("501 Specified path is a directory\r\n"s),
+                            35,
+                            _handledConnection->defaultAsyncOpHandler
+                    );
+                else{
+                    _handledConnection->ring()->async_write(
+                            _handledConnection->fd(),
+                            std::make_shared<std::string>("150 Opened data connection\r\n"s),
+                            28,
+                            [this, path, restartOffset](int res) mutable {
+                                _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::receiver, [this](){
+                                    _handledConnection->ring()->async_write(
+                                            _handledConnection->fd(),
+                                            std::make_shared<std::string>("250 Operation successful\r\n"),
+                                            26,
+                                            _handledConnection->defaultAsyncOpHandler
+                                    );
+                                }, restartOffset);}
+                    );
+                }
+            });
+        };
+        if(restartOffset) {
+            //The upload resumes the latest version, so the marker must lie within it.
+            _handledConnection->fileSystem()->facts(_handledConnection->ring(), path, [this, restartOffset, store = std::move(store)](
+                    std::optional<FileSystemProxy::Facts> &&facts) mutable {
+                if(!facts || facts->directory || facts->size < restartOffset) {
+                    _handledConnection->ring()->async_write(
+                            _handledConnection->fd(),
+                            std::make_shared<std::string>("554 Invalid REST parameter\r\n"s),
+                            28,
+                            _handledConnection->defaultAsyncOpHandler
+                    );
+                    return;
+                }
+                store();
+            });
+            return;
+        }
+        store();
+    }
+
+    void ControlConnectionStateLoggedIn::rest(const std::string& marker) {
+        std::uint64_t offset = 0;
+        auto [end, error] = std::from_chars(marker.data(), marker.data() + marker.size(), offset);
+        if(marker.empty() || error != std::errc() || end != marker.data() + marker.size())
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("501 Specified path is a directory\r\n"s),
-                    35,
+                    std::make_shared<std::string>("501 Invalid REST parameter\r\n"s),
+                    28,
                     _handledConnection->defaultAsyncOpHandler
             );
-        else{
+        //Only the STREAM restart of RFC 3659 is supported, in which the marker is an offset into the stored bytes.
+        else if(_handledConnection->representationType() != RepresentationType::Image)
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("150 Opened data connection\r\n"s),
-                    28,
-                    [this, path](int res) mutable {
-                        _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::sender, [this](){
-                            _handledConnection->ring()->async_write(
-                                    _handledConnection->fd(),
-                                    std::make_shared<std::string>("250 Operation successful\r\n"),
-                                    26,
-                                    _handledConnection->defaultAsyncOpHandler
-                            );
-                        });}
+                    std::make_shared<std::string>("504 REST is supported in TYPE I only\r\n"s),
+                    38,
+                    _handledConnection->defaultAsyncOpHandler
             );
+        else {
+            _handledConnection->setRestartOffset(offset);
+            auto reply = std::make_shared<std::string>("350 Restarting at "s + std::to_string(offset) + "\r\n"s);
+            std::size_t length = reply->size();
+            _handledConnection->ring()->async_write(_handledConnection->fd(), std::move(reply), length,
+                                                    _handledConnection->defaultAsyncOpHandler);
         }
     }
 
-    void ControlConnectionStateLoggedIn::stor(std::filesystem::path path) {
-        //Stor operation is allowed only on existing files.
-        std::string fullPath;
+    void ControlConnectionStateLoggedIn::pwd() const {
+        std::filesystem::path path = "/"/_handledConnection->pwd();
+        _handledConnection->ring()->async_write(
+                _handledConnection->fd(),
+                std::make_shared<std::string>("200 "s + path.string() + "\r\n"s),
+                6 + path.string().size(),
+                _handledConnection->defaultAsyncOpHandler
+        );
+    }
+
+    void ControlConnectionStateLoggedIn::list(std::filesystem::path path) const {
         try {
             path = parsePath(_handledConnection->pwd(), path);
-            fullPath = _handledConnection->root()/path;
         } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
@@ -300,51 +423,107 @@ namespace ftp{
             );
             return;
         }
+        _handledConnection->statPath(path, [this, path](int res, std::uint16_t mode) mutable {
+            if(res == 0 && S_ISDIR(mode)) {
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("150 Opened data connection\r\n"s),
+                        28,
+                        [this, path](int res) mutable {
+                            _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::lister, [this](){
+                                _handledConnection->ring()->async_write(
+                                        _handledConnection->fd(),
+                                        std::make_shared<std::string>("250 Operation successful\r\n"),
+                                        26,
+                                        _handledConnection->defaultAsyncOpHandler
+                                );
+                            });}
+                );
+            }
+            else
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("501 specified path is not a directory\r\n"s),
+                        39,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+        });
+    }
 
-        if(!std::filesystem::exists(fullPath))
+    void ControlConnectionStateLoggedIn::mlsd(std::filesystem::path path) const {
+        try {
+            path = parsePath(_handledConnection->pwd(), path);
+        } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("501 File does not exist\r\n"s),
-                    25,
+                    std::make_shared<std::string>("501 Illegal path\r\n"s),
+                    18,
                     _handledConnection->defaultAsyncOpHandler
             );
-        else if(std::filesystem::is_directory(fullPath))
+            return;
+        }
+        _handledConnection->fileSystem()->facts(_handledConnection->ring(), path, [this, path](std::optional<FileSystemProxy::Facts> &&facts) mutable {
+            if(facts && facts->directory)
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("150 Opened data connection\r\n"s),
+                        28,
+                        [this, path](int res) mutable {
+                            _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::machineLister, [this](){
+                                _handledConnection->ring()->async_write(
+                                        _handledConnection->fd(),
+                                        std::make_shared<std::string>("250 Operation successful\r\n"),
+                                        26,
+                                        _handledConnection->defaultAsyncOpHandler
+                                );
+                            });}
+                );
+            else
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("501 specified path is not a directory\r\n"s),
+                        39,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+        });
+    }
+
+    void ControlConnectionStateLoggedIn::mlst(std::filesystem::path path) const {
+        try {
+            path = parsePath(_handledConnection->pwd(), path);
+        } catch (const std::exception &e) {
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("501 Specified path is a directory\r\n"s),
-                    35,
+                    std::make_shared<std::string>("501 Illegal path\r\n"s),
+                    18,
                     _handledConnection->defaultAsyncOpHandler
             );
-        else{
+            return;
+        }
+        _handledConnection->fileSystem()->facts(_handledConnection->ring(), path, [this, path](std::optional<FileSystemProxy::Facts> &&facts) mutable {
+            if(!facts) {
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("550 File does not exist\r\n"s),
+                        25,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+                return;
+            }
+            //The facts go on a line of their own, opened by a space, between the lines of the 250 reply.
+            std::string name = ("/" / path).string();
+            std::string reply = "250-Listing "s + name + "\r\n " + formatFacts(*facts) + ' ' + name + "\r\n250 End\r\n";
+            std::size_t length = reply.size();
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("150 Opened data connection\r\n"s),
-                    28,
-                    [this, path](int res) mutable {
-                        _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::receiver, [this](){
-                            _handledConnection->ring()->async_write(
-                                    _handledConnection->fd(),
-                                    std::make_shared<std::string>("250 Operation successful\r\n"),
-                                    26,
-                                    _handledConnection->defaultAsyncOpHandler
-                            );
-                        });}
+                    std::make_shared<std::string>(std::move(reply)),
+                    length,
+                    _handledConnection->defaultAsyncOpHandler
             );
-        }
+        });
     }
 
-    void ControlConnectionStateLoggedIn::pwd() const {
-        std::filesystem::path path = "/"/_handledConnection->pwd();
-        _handledConnection->ring()->async_write(
-                _handledConnection->fd(),
-                std::make_shared<std::string>("200 "s + path.string() + "\r\n"s),
-                6 + path.string().size(),
-                _handledConnection->defaultAsyncOpHandler
-        );
-    }
-
-    void ControlConnectionStateLoggedIn::list(std::filesystem::path path) const {
-        //Проходом по directory_iterator выбираем все файлы и отправляем их filenames
+    void ControlConnectionStateLoggedIn::size(std::filesystem::path path) const {
         try {
             path = parsePath(_handledConnection->pwd(), path);
         } catch (const std::exception &e) {
@@ -356,30 +535,59 @@ namespace ftp{
             );
             return;
         }
-        if(std::filesystem::is_directory(_handledConnection->root()/path)) {
+        //The size of the stored bytes, which is the size of the Image type transfer.
+        _handledConnection->fileSystem()->facts(_handledConnection->ring(), path, [this](std::optional<FileSystemProxy::Facts> &&facts) mutable {
+            if(!facts || facts->directory) {
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("550 File does not exist\r\n"s),
+                        25,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+                return;
+            }
+            std::string reply = "213 "s + std::to_string(facts->size) + "\r\n";
+            std::size_t length = reply.size();
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("150 Opened data connection\r\n"s),
-                    28,
-                    [this, path](int res) mutable {
-                        _handledConnection->postDataSendTask(std::move(path), DataConnectionMode::lister, [this](){
-                            _handledConnection->ring()->async_write(
-                                    _handledConnection->fd(),
-                                    std::make_shared<std::string>("250 Operation successful\r\n"),
-                                    26,
-                                    _handledConnection->defaultAsyncOpHandler
-                            );
-                        });}
+                    std::make_shared<std::string>(std::move(reply)),
+                    length,
+                    _handledConnection->defaultAsyncOpHandler
             );
+        });
+    }
 
+    void ControlConnectionStateLoggedIn::mdtm(std::filesystem::path path) const {
+        try {
+            path = parsePath(_handledConnection->pwd(), path);
+        } catch (const std::exception &e) {
+            _handledConnection->ring()->async_write(
+                    _handledConnection->fd(),
+                    std::make_shared<std::string>("501 Illegal path\r\n"s),
+                    18,
+                    _handledConnection->defaultAsyncOpHandler
+            );
+            return;
         }
-        else
+        _handledConnection->fileSystem()->facts(_handledConnection->ring(), path, [this](std::optional<FileSystemProxy::Facts> &&facts) mutable {
+            if(!facts || facts->directory) {
+                _handledConnection->ring()->async_write(
+                        _handledConnection->fd(),
+                        std::make_shared<std::string>("550 File does not exist\r\n"s),
+                        25,
+                        _handledConnection->defaultAsyncOpHandler
+                );
+                return;
+            }
+            std::string reply = "213 "s + formatTime(facts->modified) + "\r\n";
+            std::size_t length = reply.size();
             _handledConnection->ring()->async_write(
                     _handledConnection->fd(),
-                    std::make_shared<std::string>("501 specified path is not a directory\r\n"s),
-                    39,
+                    std::make_shared<std::string>(std::move(reply)),
+                    length,
                     _handledConnection->defaultAsyncOpHandler
             );
+        });
     }
 
     void ControlConnectionStateLoggedIn::pasv() {
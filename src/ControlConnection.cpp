@@ -5,9 +5,27 @@
 #include <cstdio>
 #include <filesystem>
 #include <cassert>
+#include <limits>
+#include <ctime>
 
 namespace ftp{
 
+    std::string formatTime(std::int64_t time) {
+        std::time_t seconds = time;
+        std::tm utc{};
+        gmtime_r(&seconds, &utc);
+        char result[16];
+        std::strftime(result, sizeof(result), "%Y%m%d%H%M%S", &utc);
+        return result;
+    }
+
+    std::string formatFacts(const FileSystemProxy::Facts& facts) {
+        //Files can be retrieved and overwritten, directories entered, listed and stored into.
+        if(facts.directory)
+            return "type=dir;modify="s + formatTime(facts.modified) + ";perm=cel;";
+        return "type=file;size="s + std::to_string(facts.size) + ";modify=" + formatTime(facts.modified) + ";perm=rw;";
+    }
+
     //GotW #29: реализуем case-insensitive строки
     struct ci_char_traits: public std::char_traits<char>{
         static bool eq(char l, char r){ return toupper(l) == toupper(r); }
@@ -30,14 +48,37 @@ namespace ftp{
     using ci_string = std::basic_string<char, ci_char_traits>;
 
     void ControlConnection::startActing() {
-        _parent->enqueueConnection(_parent->fd(),
-                          std::make_shared<ControlConnection>(
-                                  _parent,
-                                  std::move(_root),
-                                  std::move(_fileSystem)
-                          )
-                          );
         _state = std::make_unique<ControlConnectionStateNotLoggedIn>(this);
+        if(_ring->has_provided_buffers()) {
+            //An idle session holds no read buffer: the ring lends one only when a command arrives.
+            _inbox = std::make_shared<RecvQueue>();
+            //The greeting counts as the first command, the ones arriving before it is sent wait in the inbox.
+            _processing = true;
+            _receiving = true;
+            //The connection stays alive as long as the recv does, even if the parent has dropped it meanwhile.
+            _ring->async_recv_multishot(_fd, _inbox, [this, self = shared_from_this()](std::int64_t res){
+                if(res > 0) {
+                    if(!_stopped)
+                        processPending();
+                    return;
+                }
+                //The last completion of the recv.
+                int fd;
+                {
+                    auto lk = std::lock_guard(_stopMutex);
+                    _receiving = false;
+                    fd = std::exchange(_lingeringFd, -1);
+                }
+                if(fd < 0) {
+                    //The client has gone first.
+                    stop();
+                    return;
+                }
+                _ring->unregister_file(fd);
+                close(fd);
+            });
+        } else
+            _command->reserve(500);
         _ring->async_write(
                 _fd,
                 std::make_shared<std::string>("220-Connection Established\r\n220-Note that this server accepts only\r\n220 anonymous access mode.\r\n"s),
@@ -46,6 +87,24 @@ namespace ftp{
         );
     }
 
+    void ControlConnection::stop() {
+        {
+            auto lk = std::lock_guard(_stopMutex);
+            if(_stopped.exchange(true))
+                return;
+            if(_receiving && _fd >= 0) {
+                //Ends the recv, whose last completion closes the descriptor.
+                shutdown(_fd, SHUT_RDWR);
+                _lingeringFd = std::exchange(_fd, -1);
+            }
+        }
+        {
+            auto lk = std::lock_guard(_pasvMutex);
+            closePasv();
+        }
+        ConnectionBase::stop();
+    }
+
     void ControlConnection::processCommand(std::size_t commandLen) {
         if(commandLen < 0)
             stop();
@@ -79,6 +138,8 @@ namespace ftp{
             _state->retr(commandField);
         } else if (controlSeq == "STOR"){
             _state->stor(commandField);
+        } else if (controlSeq == "REST"){
+            _state->rest(commandField);
         } else if (controlSeq == "PWD"){
             _state->pwd();
         } else if (controlSeq == "LIST"){
@@ -87,24 +148,55 @@ namespace ftp{
             _state->noop();
         } else if (controlSeq == "PASV"){
             _state->pasv();
+        } else if (controlSeq == "MLSD"){
+            _state->mlsd(commandField);
+        } else if (controlSeq == "MLST"){
+            _state->mlst(commandField);
+        } else if (controlSeq == "SIZE"){
+            _state->size(commandField);
+        } else if (controlSeq == "MDTM"){
+            _state->mdtm(commandField);
+        } else if (controlSeq == "FEAT"){
+            _state->feat();
         } else {
             _ring->async_write(_fd, std::make_shared<std::string>("500 Incorrect Command\r\n"s), 23, defaultAsyncOpHandler);
         }
     }
 
+    void ControlConnection::processPending() {
+        while(!_processing.exchange(true)) {
+            {
+                auto lk = std::lock_guard(_inbox->mutex);
+                if(auto end = _inbox->data.find("\r\n"); end != std::string::npos) {
+                    _command->assign(_inbox->data, 0, end + 2);
+                    _inbox->data.erase(0, end + 2);
+                    if(_inbox->data.empty())
+                        _inbox->data.shrink_to_fit();
+                }
+            }
+            if(!_command->empty()) {
+                processCommand(_command->size());
+                return;
+            }
+            _processing = false;
+            //Bytes arriving between the lookup and the release found us busy, so they are ours to process.
+            auto lk = std::lock_guard(_inbox->mutex);
+            if(_inbox->data.find("\r\n") == std::string::npos)
+                return;
+        }
+    }
+
     void ControlConnection::makePasv() {
-        if(_pasvFD >= 0)
-            close(_pasvFD);
-         _pasvFD = socket(_localAddr.sin_family, SOCK_STREAM, 0);
+         int pasvFD = socket(_localAddr.sin_family, SOCK_STREAM, 0);
          struct sockaddr_in _pasvAddr{};
          socklen_t _pasvAddrLen;
         _pasvAddr.sin_family = _localAddr.sin_family;
         _pasvAddr.sin_addr = _localAddr.sin_addr;
         _pasvAddr.sin_port = 0;
         _pasvAddrLen = sizeof(_pasvAddr);
-        bind(_pasvFD, reinterpret_cast<sockaddr*>(&_pasvAddr), _pasvAddrLen);
-        listen(_pasvFD, 20);
-        getsockname(_pasvFD, reinterpret_cast<sockaddr*>(&_pasvAddr), &_pasvAddrLen);
+        bind(pasvFD, reinterpret_cast<sockaddr*>(&_pasvAddr), _pasvAddrLen);
+        listen(pasvFD, 20);
+        getsockname(pasvFD, reinterpret_cast<sockaddr*>(&_pasvAddr), &_pasvAddrLen);
 
         std::uint32_t ip = ntohl(_pasvAddr.sin_addr.s_addr);
         std::uint16_t port = ntohs(_pasvAddr.sin_port);
@@ -116,132 +208,547 @@ namespace ftp{
            << (ip & 0xFF) << ","
            << ((port & 0xFF00) >> 8) << ","
            << (port & 0xFF) << ").\r\n";
-        auto connection = std::make_shared<DataConnection>(
-                this,
-                std::move(_fileSystem),
-                [](){}
-        );
+        //The data connection object is built only once the client actually connects. The accept keeps the
+        //connection alive, as the control recv does, until closePasv() ends it.
+        auto onDataConnection = [this, self = shared_from_this(), pasvFD](std::int64_t res){
+            if(res < 0)
+                return;
+            std::shared_ptr<DataConnection> connection;
+            std::function<void()> pendingTask;
+            {
+                auto lk = std::lock_guard(_pasvMutex);
+                if(pasvFD == _pasvFD) {
+                    connection = std::make_shared<DataConnection>(this, std::shared_ptr<FileSystemProxy>(_fileSystem),
+                                                                  _readAhead, _directIoThreshold, _listingCache);
+                    _currentPasvChild = connection;
+                    pendingTask = std::exchange(_pendingDataTask, nullptr);
+                }
+            }
+            if(!connection) {
+                //Late client of a replaced PASV socket.
+                close(res);
+                return;
+            }
+            adoptConnection(res, std::move(connection));
+            if(pendingTask)
+                pendingTask();
+        };
+        {
+            //Whatever the previous PASV offered is void from now on. The accept is armed before stop() may close
+            //the socket.
+            auto lk = std::lock_guard(_pasvMutex);
+            closePasv();
+            _pasvFD = pasvFD;
+            _currentPasvChild.reset();
+            _pendingDataTask = nullptr;
+            if(_ring->supports_multishot_accept())
+                _ring->async_sock_accept_multishot(pasvFD, onDataConnection);
+            else
+                _ring->async_sock_accept(pasvFD, nullptr, nullptr, 0, onDataConnection);
+        }
         _ring->async_write(
                 _fd,
                 std::make_shared<std::string>(ss.str()),
                 ss.str().size(),
-                [this, connection](int res) mutable {
-                    enqueueConnection(
-                            _pasvFD,
-                            std::move(connection)
-                    );
-                    defaultAsyncOpHandler(res);
-                }
+                defaultAsyncOpHandler
         );
-        _currentPasvChild = connection;
     }
 
     void ControlConnection::postDataSendTask(std::filesystem::path&& path, DataConnectionMode mode,
-                                             std::function<void()>&& dataTransferEndCallback) {
-        if(_currentPasvChild)
-            _currentPasvChild->command(std::move(path), mode, _type, std::move(dataTransferEndCallback));
+                                             std::function<void()>&& dataTransferEndCallback,
+                                             std::uint64_t restartOffset) {
+        std::shared_ptr<DataConnection> connection;
+        {
+            auto lk = std::lock_guard(_pasvMutex);
+            if(!_currentPasvChild) {
+                if(_pasvFD >= 0)
+                    //The client has not connected to the PASV socket yet - start the transfer once it does.
+                    _pendingDataTask = [this, path = std::move(path), mode, restartOffset,
+                                        cb = std::move(dataTransferEndCallback)]() mutable {
+                        postDataSendTask(std::move(path), mode, std::move(cb), restartOffset);
+                    };
+                return;
+            }
+            connection = _currentPasvChild;
+        }
+        connection->command(std::move(path), mode, _type, restartOffset, std::move(dataTransferEndCallback));
     }
 
 
+    void ControlConnection::statPath(const std::filesystem::path& relativePath,
+                                     std::function<void(int, std::uint16_t)>&& cb) {
+        auto result = std::make_shared<struct statx>();
+        _ring->async_statx(AT_FDCWD, _root / relativePath, 0, STATX_TYPE, result,
+                           [result, cb = std::move(cb)](std::int64_t res){
+            cb(int(res), res == 0 ? result->stx_mode : 0);
+        });
+    }
+
     void DataConnection::command(path &&pathToFile, DataConnectionMode mode,
                                  RepresentationType type,
+                                 std::uint64_t restartOffset,
                                  std::function<void()> &&dataTransmissionEndCallback) {
         _pathToFile = pathToFile;
         _mode = mode;
         _dataTransmissionEndCallback = dataTransmissionEndCallback;
         _type = type;
-        _bytesRead = 0;
+        //A resumed transfer starts at the marker on both ends: RETR reads the file from there and STOR writes
+        //there, into a new version that keeps the bytes before it.
+        _bytesRead = restartOffset;
+        _encoder.reset();
+        _decoder.reset();
 
-        if(_mode == DataConnectionMode::sender)
-            _fileFd = _fileSystem->open(_pathToFile, FileSystemProxy::OpenMode::readonly);
-        else if (_mode == DataConnectionMode::receiver)
-            _fileFd = _fileSystem->open(_pathToFile, FileSystemProxy::OpenMode::writeonly);
-        else {
-            _fileStruct = popen(("ls -l " + _pathToFile.string()).c_str(), "r");
-            _fileFd = _fileStruct->_fileno;
+        if(_mode == DataConnectionMode::lister) {
+            _fileFd = -1;
+            sendListing();
+            return;
+        }
+        if(_mode == DataConnectionMode::machineLister) {
+            _fileFd = -1;
+            sendMachineListing();
+            return;
+        }
+        _fileSystem->open(_ring, _pathToFile,
+                          _mode == DataConnectionMode::sender ? FileSystemProxy::OpenMode::readonly
+                                                              : FileSystemProxy::OpenMode::writeonly,
+                          [this](int fd){
+            _fileFd = fd;
+            startTransfer();
+        }, _mode == DataConnectionMode::receiver ? restartOffset : 0);
+    }
+
+    void DataConnection::startTransfer() {
+        _ring->register_file(_fileFd);
+        if(_mode == DataConnectionMode::sender && _fileFd >= 0 && startDirectIo()) {
+            startReadAhead();
+            return;
         }
+        if(_mode == DataConnectionMode::sender && _fileFd >= 0)
+            //Widens the kernel read-ahead, which is all the splice sender gets.
+            posix_fadvise(_fileFd, 0, 0, POSIX_FADV_SEQUENTIAL);
         //Now we have opened the requested file and need to start the connection session
+        if(_mode == DataConnectionMode::sender && _type == RepresentationType::Image && _fileFd >= 0 &&
+           _ring->supports(IORING_OP_SPLICE) && openPipe()) {
+            spliceFile();
+            return;
+        }
+        if(_mode == DataConnectionMode::sender && _fileFd >= 0 && _readAhead > 1) {
+            startReadAhead();
+            return;
+        }
+        if(_type == RepresentationType::Image && _ring->buffer_pool())
+            //Falls back to the heap buffer if the pool is exhausted.
+            _transferBuffer = _ring->buffer_pool()->acquire();
         continue_transmission(0);
     }
 
+    bool DataConnection::startDirectIo() {
+        _direct = false;
+        if(!_directIoThreshold || !_ring->file_ring() || _type != RepresentationType::Image ||
+           _bytesRead % directIoAlignment)
+            return false;
+        //Known from the file table, so the small files cost no extra system call.
+        auto facts = _fileSystem->knownFacts(_pathToFile);
+        if(!facts || facts->size < _directIoThreshold)
+            return false;
+        auto lk = std::lock_guard(_readAheadMutex);
+        _slots.clear();
+        _slots.resize(_readAhead);
+        for(auto& slot: _slots)
+            if(!(slot.fixed = _ring->buffer_pool()->acquire())) {
+                //A heap buffer would not be aligned - leave the file to the buffered senders.
+                _slots.clear();
+                return false;
+            }
+        //Not every filesystem supports O_DIRECT, tmpfs for one refuses it.
+        int flags = fcntl(_fileFd, F_GETFL);
+        _direct = flags >= 0 && fcntl(_fileFd, F_SETFL, flags | O_DIRECT) == 0;
+        if(!_direct)
+            _slots.clear();
+        return _direct;
+    }
+
+    void DataConnection::startReadAhead() {
+        auto lk = std::lock_guard(_readAheadMutex);
+        if(!_direct) {
+            _slots.clear();
+            _slots.resize(_readAhead);
+            for(auto& slot: _slots) {
+                if(_type == RepresentationType::Image && _ring->buffer_pool())
+                    slot.fixed = _ring->buffer_pool()->acquire();
+                if(!slot.fixed)
+                    slot.heap = std::make_shared<std::string>();
+            }
+        }
+        _nextSlot = 0;
+        _readOffset = _bytesRead;
+        _eofOffset = std::numeric_limits<std::uint64_t>::max();
+        _readsInFlight = 0;
+        _writing = false;
+        _failed = false;
+        for(std::size_t i = 0; i < _slots.size(); i++)
+            readSlot(i);
+    }
+
+    void DataConnection::readSlot(std::size_t index) {
+        auto& slot = _slots[index];
+        slot.offset = _readOffset;
+        if(_failed || _readOffset >= _eofOffset) {
+            //Nothing left to read, the slot only marks the end for writeNextSlot().
+            slot.length = 0;
+            return;
+        }
+        slot.length = -1;
+        _readOffset += slot.fixed ? slot.fixed->data().size() : readAheadChunkSize;
+        postRead(index);
+    }
+
+    void DataConnection::releaseSlot() {
+        std::size_t done = _nextSlot;
+        _nextSlot = (_nextSlot + 1) % _slots.size();
+        readSlot(done);
+    }
+
+    void DataConnection::postRead(std::size_t index) {
+        auto& slot = _slots[index];
+        std::size_t size = slot.fixed ? slot.fixed->data().size() : readAheadChunkSize;
+        auto onRead = [this, index, size, direct = _direct](std::int64_t res){
+            bool finished;
+            {
+                auto lk = std::lock_guard(_readAheadMutex);
+                _readsInFlight--;
+                if(direct && (res == -EOPNOTSUPP || res == -EINVAL)) {
+                    //The device can not be polled or the filesystem wants a greater alignment: read on buffered,
+                    //along with the other reads that went to the file ring meanwhile.
+                    int flags = fcntl(_fileFd, F_GETFL);
+                    if(!_direct || (flags >= 0 && fcntl(_fileFd, F_SETFL, flags & ~O_DIRECT) == 0)) {
+                        _direct = false;
+                        postRead(index);
+                        return;
+                    }
+                }
+                auto& slot = _slots[index];
+                slot.length = std::max<std::int64_t>(res, 0);
+                if(res < 0)
+                    _failed = true;
+                else if(static_cast<std::size_t>(res) < size)
+                    //eof reached - the slots ahead of this one read past it
+                    _eofOffset = std::min(_eofOffset, slot.offset + res);
+                finished = writeNextSlot();
+            }
+            if(finished)
+                endTransmission();
+        };
+        if(_direct)
+            //The descriptor is not in the fixed table of the file ring, but the buffer is.
+            _ring->file_ring()->async_read_fixed(_fileFd, slot.fixed->data(), slot.fixed, onRead, slot.offset);
+        else if(slot.fixed)
+            _ring->async_read_fixed(_fileFd, slot.fixed->data(), slot.fixed, onRead, slot.offset);
+        else {
+            slot.heap->resize(size);
+            _ring->async_read_some(_fileFd, std::shared_ptr<std::string>(slot.heap), onRead, slot.offset);
+        }
+        _readsInFlight++;
+    }
+
+    bool DataConnection::writeNextSlot() {
+        if(_writing)
+            return false;
+        auto& slot = _slots[_nextSlot];
+        if(slot.length < 0)
+            //The next chunk in file order is still being read.
+            return false;
+        if(_failed || slot.length == 0 || slot.offset >= _eofOffset)
+            //Done, as soon as the reads still in flight are back.
+            return _readsInFlight == 0;
+        std::int64_t length = std::min<std::uint64_t>(slot.length, _eofOffset - slot.offset);
+        _writing = true;
+        _chunkEnd = slot.offset + length;
+        _slotReleased = false;
+        if(slot.fixed) {
+            writeChunk(nullptr, length, 0, false);
+            return false;
+        }
+        slot.heap->resize(length);
+        auto* outgoing = &slot.heap;
+        if(_type == RepresentationType::ASCII) {
+            _converted->clear();
+            _encoder.encode(*slot.heap, *_converted);
+            outgoing = &_converted;
+            //The converted copy is what gets sent, so the slot reads on meanwhile.
+            releaseSlot();
+            _slotReleased = true;
+        }
+        std::size_t size = (*outgoing)->size();
+        if(size < zeroCopyThreshold || !_ring->supports(IORING_OP_SEND_ZC))
+            writeChunk(*outgoing, size, 0, false);
+        else
+            //The kernel keeps reading the pages after the result arrives, so the next chunk gets a new buffer.
+            writeChunk(std::exchange(*outgoing, std::make_shared<std::string>()), size, 0, true);
+        return false;
+    }
+
+    void DataConnection::writeChunk(std::shared_ptr<std::string> outgoing, std::size_t size, std::size_t written,
+                                    bool zeroCopy) {
+        auto& slot = _slots[_nextSlot];
+        auto onWritten = [this, outgoing, size, written, zeroCopy](std::int64_t res){
+            bool finished;
+            {
+                auto lk = std::lock_guard(_readAheadMutex);
+                if(res > 0 && written + res < size) {
+                    //Short write: the rest of the chunk goes out before the next slot.
+                    writeChunk(outgoing, size, written + res, zeroCopy);
+                    return;
+                }
+                _writing = false;
+                if(res <= 0)
+                    //the socket is gone
+                    _failed = true;
+                else {
+                    _bytesRead = _chunkEnd;
+                    if(!_slotReleased)
+                        //The slot is free again - put it to reading the next chunk.
+                        releaseSlot();
+                }
+                finished = writeNextSlot();
+            }
+            if(finished)
+                endTransmission();
+        };
+        if(slot.fixed) {
+            _ring->async_write_fixed(_fd, slot.fixed->data().subspan(written, size - written), slot.fixed, onWritten);
+            return;
+        }
+        std::span<const std::byte> rest(reinterpret_cast<const std::byte*>(outgoing->data()) + written, size - written);
+        if(zeroCopy)
+            _ring->async_send_zc(_fd, rest, std::shared_ptr<std::string>(outgoing), onWritten);
+        else
+            _ring->async_write_some(_fd, rest, std::shared_ptr<std::string>(outgoing), onWritten);
+    }
+
+    void DataConnection::transferFixed() {
+        //Image type passes the data on untouched, so one registered buffer serves both halves of the round,
+        //which go to the kernel as a single linked chain.
+        bool sending = _mode == DataConnectionMode::sender;
+        int source = sending ? _fileFd : _fd, destination = sending ? _fd : _fileFd;
+        std::uint64_t readOffset = sending ? _bytesRead : 0, writeOffset = sending ? 0 : _bytesRead;
+        _ring->async_read_write_fixed(source, readOffset, destination, writeOffset, _transferBuffer->data(),
+                                      _transferBuffer, [this, destination, writeOffset](std::int64_t read,
+                                                                                        std::int64_t written){
+            if(read <= 0) {
+                //eof reached or the peer closed the connection
+                endTransmission();
+                return;
+            }
+            _bytesRead += read;
+            if(written == -ECANCELED)
+                //The short read broke the chain, the bytes are still in the buffer.
+                writeFixedRest(destination, writeOffset, read, 0);
+            else if(written < 0)
+                continue_transmission(written);
+            else
+                writeFixedRest(destination, writeOffset, read, written);
+        }, !sending);
+    }
+
+    void DataConnection::writeFixedRest(int destination, std::uint64_t writeOffset, std::size_t size,
+                                        std::size_t written) {
+        if(written >= size) {
+            continue_transmission(static_cast<std::int64_t>(size));
+            return;
+        }
+        //The socket ignores the offset, the file gets the rest of the chunk where the written part ends.
+        std::uint64_t offset = destination == _fd ? 0 : writeOffset + written;
+        _ring->async_write_fixed(destination, _transferBuffer->data().subspan(written, size - written), _transferBuffer,
+                                 [this, destination, writeOffset, size, written](std::int64_t res){
+            if(res <= 0) {
+                //the socket is gone or the disk is full
+                endTransmission();
+                return;
+            }
+            writeFixedRest(destination, writeOffset, size, written + res);
+        }, offset);
+    }
+
+    bool DataConnection::openPipe() {
+        //pipe2 hands back {read end, write end}, async_splice_through expects the same layout.
+        if(pipe2(_pipe.data(), O_CLOEXEC))
+            return false;
+        //The pipe buffer bounds a single round, so it has to fit the whole chunk.
+        fcntl(_pipe[1], F_SETPIPE_SZ, spliceChunkSize);
+        _ring->register_file(_pipe[0]);
+        _ring->register_file(_pipe[1]);
+        _pipeFill = 0;
+        return true;
+    }
+
+    Task DataConnection::spliceFile() {
+        while(true) {
+            if(_pipeFill > 0) {
+                //The socket took less than the pipe held - push the rest before reading further.
+                std::int64_t res = co_await _ring->splice(_pipe[0], -1, _fd, -1, _pipeFill);
+                if(res <= 0)
+                    break;
+                _pipeFill -= res;
+                continue;
+            }
+            auto [filled, drained] = co_await _ring->splice_through(_fileFd, _bytesRead, _pipe, _fd, spliceChunkSize);
+            if(filled <= 0)
+                //eof reached or the file read failed
+                break;
+            if(drained < 0 && drained != -ECANCELED)
+                //the socket is gone
+                break;
+            _bytesRead += filled;
+            _pipeFill += filled - std::max<std::int64_t>(drained, 0);
+        }
+        endTransmission();
+    }
+
+    void DataConnection::sendBuffer() {
+        if(_buffer->size() < zeroCopyThreshold || !_ring->supports(IORING_OP_SEND_ZC)) {
+            _ring->async_write_some(_fd, std::move(_buffer), continue_transmission);
+            return;
+        }
+        //The kernel keeps reading the pages after the result arrives, so the next chunk gets a buffer of its own.
+        auto outgoing = std::exchange(_buffer, std::make_shared<std::string>());
+        _ring->async_send_zc(_fd, std::move(outgoing), continue_transmission);
+    }
+
+    void DataConnection::sendListing() {
+        bool crlf = _type == RepresentationType::ASCII;
+        std::uint64_t generation = ListingCache::noGeneration;
+        if(_listingCache) {
+            if(auto cached = _listingCache->find(_pathToFile, crlf)) {
+                writeListing(std::move(cached));
+                return;
+            }
+            generation = _listingCache->watch(_pathToFile);
+        }
+        DirectoryLister::list(_ring, _fileSystem->root() / _pathToFile, crlf,
+                              [this, crlf, generation](std::shared_ptr<std::string>&& listing){
+            if(_listingCache && generation != ListingCache::noGeneration && !listing->empty())
+                _listingCache->store(_pathToFile, crlf, listing, generation);
+            writeListing(std::move(listing));
+        });
+    }
+
+    void DataConnection::sendMachineListing() {
+        _fileSystem->directoryFacts(_ring, _pathToFile, [this](std::optional<std::vector<FileSystemProxy::Facts>>&& entries){
+            auto listing = std::make_shared<std::string>();
+            //MLSD lines always end with CRLF, whatever the TYPE.
+            if(entries)
+                for(const auto& entry: *entries)
+                    *listing += formatFacts(entry) + ' ' + entry.name + "\r\n";
+            writeListing(std::move(listing));
+        });
+    }
+
+    void DataConnection::writeListing(std::shared_ptr<std::string>&& listing) {
+        if(listing->empty()) {
+            endTransmission();
+            return;
+        }
+        //Possibly shared with the cache and other connections, so it is only ever read.
+        std::size_t size = listing->size();
+        _ring->async_write(_fd, std::move(listing), size, [this](std::int64_t){ endTransmission(); });
+    }
+
+    void DataConnection::encodeBuffer() {
+        _converted->clear();
+        _encoder.encode(*_buffer, *_converted);
+        std::swap(_buffer, _converted);
+    }
+
+    void DataConnection::decodeBuffer() {
+        _converted->clear();
+        _decoder.decode(*_buffer, *_converted);
+        std::swap(_buffer, _converted);
+    }
+
+    void DataConnection::endTransmission() {
+        _ring->unregister_file(_fileFd);
+        for(auto& end: _pipe)
+            if(end >= 0) {
+                _ring->unregister_file(end);
+                close(end);
+                end = -1;
+            }
+        _transferBuffer.reset();
+        _slots.clear();
+        _direct = false;
+        if(_fileFd >= 0 && _mode != DataConnectionMode::lister && _mode != DataConnectionMode::machineLister) {
+            //The reply waits for the commit, so that a RETR following the STOR already gets the new version.
+            _fileSystem->close(_ring, _fileFd, [this](){
+                _dataTransmissionEndCallback();
+                stop();
+            });
+            return;
+        }
+        _dataTransmissionEndCallback();
+        stop();
+    }
+
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "VirtualCallInCtorOrDtor"
     DataConnection::DataConnection(ConnectionBase* parent,
                                    std::shared_ptr<FileSystemProxy> &&fileSystem,
+                                   unsigned readAhead,
+                                   std::uint64_t directIoThreshold,
+                                   std::shared_ptr<ListingCache> listingCache,
                                    std::function<void(void)> &&waitingForConnectionCallback):
             ConnectionBase(parent),
             _fileSystem(fileSystem),
-            _buffer(std::make_shared<std::string>()){
+            _buffer(std::make_shared<std::string>()),
+            _converted(std::make_shared<std::string>()),
+            _readAhead(std::max(readAhead, 1U)),
+            _directIoThreshold(directIoThreshold),
+            _listingCache(std::move(listingCache)){
         continue_transmission = [this](std::int64_t res){
-            _buffer->clear();
-            _buffer->resize(65500);
             if(res < 0){
                 //previous socket/file operation failed - assume it is closed.
-                if(_mode != DataConnectionMode::lister)
-                    _fileSystem->close(_fileFd);
-                else
-                    pclose(_fileStruct);
-                _dataTransmissionEndCallback();
-                stop();
+                endTransmission();
+            } else if(_transferBuffer) {
+                transferFixed();
             } else {
+                _buffer->clear();
+                _buffer->resize(65500);
                 if(_mode == DataConnectionMode::sender){
                     _ring->async_read_some(_fileFd, std::move(_buffer), [this](int res){
                         if(res > 0){
                             //read from file successful
                             _buffer->resize(res);
-                            int pos = 0;
-                            if(_type == RepresentationType::ASCII){
-                                while ((pos = _buffer->find("\n", pos + 3)) != std::string::npos)
-                                    _buffer->replace(pos, 1, "\r\n");
-                            }
+                            if(_type == RepresentationType::ASCII)
+                                encodeBuffer();
                             _bytesRead += res;
-                            _ring->async_write_some(_fd, std::move(_buffer), continue_transmission);
+                            sendBuffer();
                         } else {
                             //read from file failed - eof reached
-                            _fileSystem->close(_fileFd);
-                            _dataTransmissionEndCallback();
-                            stop();
+                            endTransmission();
                         }
                     }, _bytesRead);
-                } else if(_mode == DataConnectionMode::receiver) {
+                } else {
                     _ring->async_read_some(_fd, std::move(_buffer), [this](int res){
                         if(res > 0){
                             //read from socket successful
                             _buffer->resize(res);
-                            int pos = 0;
-                            if(_type == RepresentationType::ASCII){
-                                while ((pos = _buffer->find("\r\n", pos + 1)) != std::string::npos)
-                                    _buffer->replace(pos, 2, "\n");
-                            }
+                            if(_type == RepresentationType::ASCII)
+                                decodeBuffer();
                             _bytesRead += _buffer->size();
                             _ring->async_write_some(_fileFd, std::move(_buffer), continue_transmission, _bytesRead - _buffer->size());
                         } else {
                             //read from socket failed - connection closed
-                            _fileSystem->close(_fileFd);
-                            _dataTransmissionEndCallback();
-                            stop();
-                        }
-                    });
-                } else{
-                    //mode: lister
-                    _ring->async_read_some(_fileFd, std::move(_buffer), [this](int res){
-                        if(res > 0){
-                            //read from file successful
-                            _buffer->resize(res);
-                            int pos = 0;
-                            if(_type == RepresentationType::ASCII){
-                                while ((pos = _buffer->find('\n', pos + 2)) != std::string::npos)
-                                    _buffer->replace(pos, 1, "\r\n");
+                            _converted->clear();
+                            _decoder.finish(*_converted);
+                            if(_converted->empty()) {
+                                endTransmission();
+                                return;
                             }
-                            _bytesRead += res;
-                            _ring->async_write_some(_fd, std::move(_buffer), continue_transmission);
-                        } else {
-                            //read from file failed - eof reached
-                            pclose(_fileStruct);
-                            _dataTransmissionEndCallback();
-                            stop();
+                            //The stream ended with a CR that was held back to see whether an LF follows.
+                            _ring->async_write_some(_fileFd, std::shared_ptr<std::string>(_converted),
+                                                    [this](std::int64_t){ endTransmission(); }, _bytesRead);
                         }
-                    }, _bytesRead);
+                    });
                 }
             }
         };
@@ -0,0 +1,158 @@
+#include <DirectoryLister.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ftp {
+
+    namespace {
+        //Layout of the records filled by getdents64.
+        struct linux_dirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+
+        void formatMode(std::uint16_t mode, char* out) {
+            switch(mode & S_IFMT) {
+                case S_IFDIR: out[0] = 'd'; break;
+                case S_IFLNK: out[0] = 'l'; break;
+                case S_IFCHR: out[0] = 'c'; break;
+                case S_IFBLK: out[0] = 'b'; break;
+                case S_IFIFO: out[0] = 'p'; break;
+                case S_IFSOCK: out[0] = 's'; break;
+                default: out[0] = '-';
+            }
+            const char* rwx = "rwxrwxrwx";
+            for(int i = 0; i < 9; i++)
+                out[i + 1] = mode & (1 << (8 - i)) ? rwx[i] : '-';
+            if(mode & S_ISUID) out[3] = out[3] == 'x' ? 's' : 'S';
+            if(mode & S_ISGID) out[6] = out[6] == 'x' ? 's' : 'S';
+            if(mode & S_ISVTX) out[9] = out[9] == 'x' ? 't' : 'T';
+            out[10] = '\0';
+        }
+
+        int digits(std::uint64_t value) {
+            int count = 1;
+            while(value >= 10) {
+                value /= 10;
+                count++;
+            }
+            return count;
+        }
+    }
+
+    void DirectoryLister::list(const std::shared_ptr<AsyncUring>& ring, const std::filesystem::path& directory,
+                               bool crlf, ListingCallback&& cb) {
+        auto lister = std::shared_ptr<DirectoryLister>(new DirectoryLister(ring, crlf, std::move(cb)));
+        if(!lister->readEntries(directory)) {
+            auto callback = std::move(lister->_cb);
+            callback(std::make_shared<std::string>());
+            return;
+        }
+        if(!ring->supports(IORING_OP_STATX))
+            for(auto& entry: lister->_entries)
+                entry.result = statx(lister->_directoryFd, entry.name.c_str(), AT_SYMLINK_NOFOLLOW,
+                                     STATX_BASIC_STATS, &entry.stat) ? -errno : 0;
+        lister->statNextBatch();
+    }
+
+    bool DirectoryLister::readEntries(const std::filesystem::path& directory) {
+        _directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(_directoryFd < 0)
+            return false;
+        alignas(linux_dirent64) char buffer[1UL << 15];
+        long read;
+        while((read = syscall(SYS_getdents64, _directoryFd, buffer, sizeof(buffer))) > 0)
+            for(long offset = 0; offset < read;) {
+                auto* record = reinterpret_cast<linux_dirent64*>(buffer + offset);
+                offset += record->d_reclen;
+                //Covers ., .. and the .tmp storage of the file versions, along with the hidden files.
+                if(record->d_name[0] != '.')
+                    _entries.push_back({record->d_name});
+            }
+        std::sort(_entries.begin(), _entries.end(), [](const Entry& lhs, const Entry& rhs){
+            return lhs.name < rhs.name;
+        });
+        return read == 0;
+    }
+
+    void DirectoryLister::statNextBatch() {
+        std::size_t begin = _nextEntry, end = begin;
+        if(_ring->supports(IORING_OP_STATX))
+            end = std::min(begin + statxBatch, _entries.size());
+        if(begin == end) {
+            auto listing = std::make_shared<std::string>();
+            format(*listing);
+            auto callback = std::move(_cb);
+            callback(std::move(listing));
+            return;
+        }
+        //The last completion of the batch posts the next one, possibly before this loop is over.
+        _nextEntry = end;
+        _pending = end - begin;
+        auto self = shared_from_this();
+        for(std::size_t i = begin; i < end; i++)
+            _ring->async_statx(_directoryFd, _entries[i].name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                               &_entries[i].stat, [self, i](std::int64_t res){
+                self->_entries[i].result = int(std::min<std::int64_t>(res, 0));
+                if(self->_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    self->statNextBatch();
+            });
+    }
+
+    void DirectoryLister::format(std::string& listing) const {
+        const char* eol = _crlf ? "\r\n" : "\n";
+        std::uint64_t blocks = 0;
+        int linkWidth = 1, uidWidth = 1, gidWidth = 1, sizeWidth = 1;
+        for(const auto& entry: _entries)
+            if(entry.result == 0) {
+                blocks += entry.stat.stx_blocks;
+                linkWidth = std::max(linkWidth, digits(entry.stat.stx_nlink));
+                uidWidth = std::max(uidWidth, digits(entry.stat.stx_uid));
+                gidWidth = std::max(gidWidth, digits(entry.stat.stx_gid));
+                sizeWidth = std::max(sizeWidth, digits(entry.stat.stx_size));
+            }
+        //ls counts 1K blocks, statx reports 512 byte ones.
+        listing += "total " + std::to_string((blocks + 1) / 2) + eol;
+
+        //Like ls, the time of day is given for the files modified within the last half a year.
+        const std::time_t now = std::time(nullptr), halfYear = 365 * 24 * 60 * 60 / 2;
+        char mode[11], date[32], line[128];
+        for(const auto& entry: _entries) {
+            if(entry.result != 0)
+                continue;
+            const auto& stat = entry.stat;
+            formatMode(stat.stx_mode, mode);
+            std::time_t modified = stat.stx_mtime.tv_sec;
+            std::tm time{};
+            localtime_r(&modified, &time);
+            bool recent = modified > now - halfYear && modified < now + halfYear;
+            std::strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &time);
+            std::snprintf(line, sizeof(line), "%s %*" PRIu32 " %*" PRIu32 " %*" PRIu32 " %*" PRIu64 " %s ",
+                          mode, linkWidth, stat.stx_nlink, uidWidth, stat.stx_uid, gidWidth, stat.stx_gid,
+                          sizeWidth, std::uint64_t(stat.stx_size), date);
+            listing += line;
+            listing += entry.name;
+            if((stat.stx_mode & S_IFMT) == S_IFLNK) {
+                char target[PATH_MAX];
+                if(ssize_t length = readlinkat(_directoryFd, entry.name.c_str(), target, sizeof(target)); length > 0)
+                    listing.append(" -> ").append(target, length);
+            }
+            listing += eol;
+        }
+    }
+
+    DirectoryLister::~DirectoryLister() {
+        if(_directoryFd >= 0)
+            ::close(_directoryFd);
+    }
+
+}
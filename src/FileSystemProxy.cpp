@@ -1,93 +1,638 @@
 #include <FileSystemProxy.h>
 
+#include <sstream>
+#include <iterator>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
 namespace ftp {
 
-    int FileSystemProxy::open(const std::filesystem::path &relativePath, FileSystemProxy::OpenMode mode) {
+    namespace {
+        std::int64_t toUnixTime(file_time_type time) {
+            return std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::file_clock::to_sys(time).time_since_epoch()).count();
+        }
+
+        std::int64_t lastWriteTime(const path& path) {
+            std::error_code ec;
+            auto time = last_write_time(path, ec);
+            return ec ? 0 : toUnixTime(time);
+        }
+
+        //Makes the first length bytes of the destination those of the source: shares the extents where the filesystem
+        //can reflink, copies them in the kernel otherwise.
+        bool copyPrefix(int source, int destination, std::uint64_t length) {
+            if (ioctl(destination, FICLONE, source) == 0)
+                return ftruncate(destination, off_t(length)) == 0;
+            loff_t sourceOffset = 0, destinationOffset = 0;
+            while (std::uint64_t(destinationOffset) < length) {
+                ssize_t copied = copy_file_range(source, &sourceOffset, destination, &destinationOffset,
+                                                 length - destinationOffset, 0);
+                if (copied <= 0)
+                    return false;
+            }
+            return true;
+        }
+
+        //The mtime in nanoseconds, which changes whenever an entry is added to, removed from or renamed in a directory.
+        std::int64_t directoryStamp(const path& path) {
+            struct stat directoryStat{};
+            if (stat(path.c_str(), &directoryStat))
+                return 0;
+            return std::int64_t(directoryStat.st_mtim.tv_sec) * 1000000000 + directoryStat.st_mtim.tv_nsec;
+        }
+    }
+
+    void FileSystemProxy::open(const std::shared_ptr<AsyncUring> &ring, const std::filesystem::path &relativePath,
+                               FileSystemProxy::OpenMode mode, OpenCallback &&cb, std::uint64_t keptBytes) {
         assert(relativePath.has_filename());
-        auto lk = std::lock_guard(_filesystemMutex);
-        if (!_fileTable.contains(relativePath))
-            updateFileTable(relativePath);
+        HashedPath key = relativePath;
+        auto &shard = shardOf(key);
+        FileVersions versions;
+        {
+            auto lk = std::shared_lock(shard._mutex);
+            if (auto found = shard._fileTable.find(key); found != shard._fileTable.end())
+                versions = found->second;
+        }
+        if (versions.empty()) {
+            //The versions on disk, if any, have to be listed first.
+            post([this, ring, key, mode, cb = std::move(cb), keptBytes]() mutable {
+                std::optional<FileVersions> versions;
+                try {
+                    versions = updateFileTable(key);
+                } catch (const std::exception &) {
+                    //An unreadable path is opened as a missing one.
+                }
+                //The open goes on with the sessions of the ring, not on the worker.
+                ring->async_nop([this, ring, key = std::move(key), versions = std::move(versions), mode,
+                                 cb = std::move(cb), keptBytes](std::int64_t) mutable {
+                    if (!versions) {
+                        cb(-1);
+                        return;
+                    }
+                    openVersion(ring, key, std::move(*versions), mode, std::move(cb), keptBytes);
+                });
+            });
+            return;
+        }
+        openVersion(ring, key, std::move(versions), mode, std::move(cb), keptBytes);
+    }
+
+    void FileSystemProxy::openVersion(const std::shared_ptr<AsyncUring> &ring, const HashedPath &key,
+                                      FileVersions &&versions, OpenMode mode, OpenCallback &&cb,
+                                      std::uint64_t keptBytes) {
+        const auto &relativePath = key._path;
         if (mode == OpenMode::readonly) {
-            if (!_fileTable[relativePath].empty()) {
-                auto file = _fileTable[relativePath].back();
-                int fd = ::open((file->_truePath).c_str(), O_RDONLY);
-                _fdTable.emplace(std::make_pair(fd, file));
-                return fd;
-            } else return -1;
-        } else {
-            //Opening file for writing purposes means updating the file stored by FTP implementation
-            // and requires creation of a new file in order to save access to previous versions
-            // for the clients who are now reading them.
-
-            //We need to do some magic about the relative path here in order to name the file uniquely
-            std::stringstream ss;
-            ss << std::chrono::system_clock::now().time_since_epoch().count();
-            path filePath = _root / ".tmp" / relativePath / ss.str();
-            create_directories(filePath.parent_path());
-            int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT, 0666);
-            auto file = std::make_shared<FTPFileEntry>();
-            file->_keyPath = relativePath;
-            file->_truePath = filePath;
-            _fdsBeingEdited.emplace(std::make_pair(fd, file));
-            _filesBeingEdited.emplace(std::make_pair(file->_keyPath, file));
-            return fd;
-        }
-    }
-
-    void FileSystemProxy::close(int fd) {
-        auto lk = std::lock_guard(_filesystemMutex);
-        if (_fdTable.contains(fd)) {
-            ::close(fd);
-            auto filePointer = _fdTable[fd];
-            _fdTable.erase(fd);
-            if (_fileTable[filePointer->_keyPath].back() != filePointer && filePointer.use_count() == 2) {
-                //This means there are only this function and the fileTable are left to own the file and
-                //the file itself is outdated, so we can safely remove it from our table (only if it is in .tmp dir)
-                _fileTable[filePointer->_keyPath].erase(
-                        std::find(
-                                _fileTable[filePointer->_keyPath].begin(),
-                                _fileTable[filePointer->_keyPath].end(),
-                                filePointer));
-                remove(filePointer->_truePath.c_str());
-            }
-        } else if (_fdsBeingEdited.contains(fd)) {
-            //This means we're trying to close a file that was opened in writeonly mode
-            //So we need to close the fd and transfer this file to the fileTable.
-            ::close(fd);
-            auto file = _fdsBeingEdited[fd];
-            for (auto it = _fileTable[file->_keyPath].begin(); it != _fileTable[file->_keyPath].end(); it++)
-                if (it->unique() && (*it)->_truePath != _root / file->_keyPath) {
-                    remove((*it)->_truePath.c_str());
-                    _fileTable[file->_keyPath].erase(it);
-                    it--;
+            if (versions.empty()) {
+                cb(-1);
+                return;
+            }
+            //The reference held by the callback keeps close() from removing the version before it is opened.
+            auto file = versions.back();
+            ring->async_openat(AT_FDCWD, file->_truePath, O_RDONLY | O_CLOEXEC, 0,
+                               [this, file, cb = std::move(cb)](std::int64_t fd) mutable {
+                if (fd < 0) {
+                    cb(-1);
+                    return;
+                }
+                {
+                    auto &descriptors = shardOf(int(fd));
+                    auto lk = std::lock_guard(descriptors._mutex);
+                    descriptors._fdTable.emplace(int(fd), std::move(file));
+                }
+                cb(int(fd));
+            });
+            return;
+        }
+        //Opening file for writing purposes means updating the file stored by FTP implementation
+        // and requires creation of a new file in order to save access to previous versions
+        // for the clients who are now reading them.
+
+        //A resumed upload starts off the bytes of the latest version before the restart marker.
+        std::shared_ptr<FTPFileEntry> source;
+        if (keptBytes) {
+            if (versions.empty()) {
+                cb(-1);
+                return;
+            }
+            source = versions.back();
+        }
+
+        //We need to do some magic about the relative path here in order to name the file uniquely
+        std::stringstream ss;
+        ss << std::chrono::system_clock::now().time_since_epoch().count();
+        auto file = std::make_shared<FTPFileEntry>();
+        file->_keyPath = key;
+        file->_truePath = _root / ".tmp" / relativePath / ss.str();
+        makeDirectories(ring, file->_truePath.parent_path(),
+                        [this, ring, file, source, keptBytes, cb = std::move(cb)](int res) mutable {
+            if (res < 0) {
+                cb(-1);
+                return;
+            }
+            ring->async_openat(AT_FDCWD, file->_truePath, O_WRONLY | O_CREAT | O_CLOEXEC, 0666,
+                               [this, ring, file, source, keptBytes, cb = std::move(cb)](std::int64_t fd) mutable {
+                if (fd < 0) {
+                    cb(-1);
+                    return;
+                }
+                if (!source) {
+                    trackEdited(int(fd), std::move(file));
+                    cb(int(fd));
+                    return;
+                }
+                ring->async_openat(AT_FDCWD, source->_truePath, O_RDONLY | O_CLOEXEC, 0,
+                                   [this, ring, file, fd, keptBytes, cb = std::move(cb)](std::int64_t sourceFd) mutable {
+                    //The copy may take a while for a large prefix, so it is made on a worker and the reply waits for it.
+                    post([this, ring, file, fd, sourceFd, keptBytes, cb = std::move(cb)]() mutable {
+                        bool copied = sourceFd >= 0 && copyPrefix(int(sourceFd), int(fd), keptBytes);
+                        if (sourceFd >= 0)
+                            ring->async_close(int(sourceFd), [](std::int64_t){});
+                        //The reply is made by the sessions of the ring, not on the worker.
+                        ring->async_nop([this, ring, file, fd, copied, cb = std::move(cb)](std::int64_t) mutable {
+                            if (copied) {
+                                trackEdited(int(fd), std::move(file));
+                                cb(int(fd));
+                                return;
+                            }
+                            //Nobody has seen the new version yet, so it is simply dropped.
+                            ring->async_close(int(fd), [ring, file, cb = std::move(cb)](std::int64_t) mutable {
+                                ring->async_unlinkat(AT_FDCWD, file->_truePath, 0,
+                                                     [cb = std::move(cb)](std::int64_t) mutable { cb(-1); });
+                            });
+                        });
+                    });
+                });
+            });
+        });
+    }
+
+    void FileSystemProxy::trackEdited(int fd, std::shared_ptr<FTPFileEntry> &&file) {
+        {
+            auto &shard = shardOf(file->_keyPath);
+            auto lk = std::unique_lock(shard._mutex);
+            shard._filesBeingEdited.insert_or_assign(file->_keyPath, file);
+        }
+        auto &descriptors = shardOf(fd);
+        auto lk = std::lock_guard(descriptors._mutex);
+        descriptors._fdsBeingEdited.emplace(fd, std::move(file));
+    }
+
+    void FileSystemProxy::makeDirectories(const std::shared_ptr<AsyncUring> &ring, const std::filesystem::path &directory,
+                                          std::function<void(int)> &&cb) {
+        ring->async_mkdirat(AT_FDCWD, directory, 0777, [this, ring, directory, cb = std::move(cb)](std::int64_t res) mutable {
+            if (res == -ENOENT && directory.parent_path() != directory) {
+                //A parent is missing as well: make it first, then try again.
+                makeDirectories(ring, directory.parent_path(), [this, ring, directory, cb = std::move(cb)](int res) mutable {
+                    if (res < 0)
+                        cb(res);
+                    else makeDirectories(ring, directory, std::move(cb));
+                });
+                return;
+            }
+            cb(res == -EEXIST ? 0 : int(res));
+        });
+    }
+
+    void FileSystemProxy::close(const std::shared_ptr<AsyncUring> &ring, int fd, std::function<void()> &&cb) {
+        std::shared_ptr<FTPFileEntry> file;
+        bool commit = false;
+        {
+            auto &descriptors = shardOf(fd);
+            auto lk = std::lock_guard(descriptors._mutex);
+            if (auto opened = descriptors._fdTable.find(fd); opened != descriptors._fdTable.end()) {
+                file = std::move(opened->second);
+                descriptors._fdTable.erase(opened);
+            } else if (auto edited = descriptors._fdsBeingEdited.find(fd); edited != descriptors._fdsBeingEdited.end()) {
+                file = std::move(edited->second);
+                descriptors._fdsBeingEdited.erase(edited);
+                commit = true;
+            }
+        }
+        if (!file) {
+            if (cb)
+                cb();
+            return;
+        }
+        if (!commit) {
+            ring->async_close(fd, [](std::int64_t) {});
+            bool outdated = false;
+            {
+                auto &shard = shardOf(file->_keyPath);
+                auto lk = std::unique_lock(shard._mutex);
+                auto &versions = shard._fileTable[file->_keyPath];
+                if (versions.back() != file && file.use_count() == 2) {
+                    //This means there are only this function and the fileTable are left to own the file and
+                    //the file itself is outdated, so we can safely remove it from our table (only if it is in .tmp dir)
+                    versions.erase(std::find(versions.begin(), versions.end(), file));
+                    outdated = true;
                 }
-            _fileTable[file->_keyPath].push_back(file);
-            _fdsBeingEdited.erase(fd);
-            _filesBeingEdited.erase(file->_keyPath);
+            }
+            if (outdated)
+                ring->async_unlinkat(AT_FDCWD, file->_truePath, 0, [](std::int64_t) {});
+            if (cb)
+                cb();
+            return;
         }
+        //This means we're trying to close a file that was opened in writeonly mode
+        //So we need to close the fd and transfer this file to the fileTable.
+        auto fileStat = std::make_shared<struct statx>();
+        ring->async_statx(fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_MTIME, fileStat,
+                          [this, ring, fd, file, fileStat, cb = std::move(cb)](std::int64_t res) mutable {
+            if (res == 0) {
+                file->_size = fileStat->stx_size;
+                file->_modified = fileStat->stx_mtime.tv_sec;
+            }
+            ring->async_close(fd, [this, ring, file, cb = std::move(cb)](std::int64_t) mutable {
+                commitVersion(ring, file);
+                if (cb)
+                    cb();
+            });
+        });
+    }
+
+    void FileSystemProxy::commitVersion(const std::shared_ptr<AsyncUring> &ring,
+                                        const std::shared_ptr<FTPFileEntry> &file) {
+        std::vector<path> superseded;
+        {
+            auto &shard = shardOf(file->_keyPath);
+            auto lk = std::unique_lock(shard._mutex);
+            auto &versions = shard._fileTable[file->_keyPath];
+            std::erase_if(versions, [this, &superseded](const std::shared_ptr<FTPFileEntry> &version) {
+                if (version.use_count() != 1 || version->_truePath == _root / version->_keyPath._path)
+                    return false;
+                superseded.push_back(version->_truePath);
+                return true;
+            });
+            versions.push_back(file);
+            if (auto edited = shard._filesBeingEdited.find(file->_keyPath);
+                    edited != shard._filesBeingEdited.end() && edited->second == file)
+                shard._filesBeingEdited.erase(edited);
+        }
+        for (auto &version: superseded)
+            ring->async_unlinkat(AT_FDCWD, std::move(version), 0, [](std::int64_t) {});
+        {
+            //A directory not indexed yet picks the file up from disk when it is.
+            auto lk = std::unique_lock(_directoryMutex);
+            if (auto parent = _directoryIndex.find(file->_keyPath._path.parent_path()); parent != _directoryIndex.end())
+                parent->second._files.insert(file->_keyPath._path.filename());
+        }
+        //Called with no lock held, the hook is free to call back into the proxy.
+        if (_commitHook)
+            _commitHook(file->_keyPath._path);
     }
 
     void FileSystemProxy::loadFileTable(const std::filesystem::path &relPath) {
+        for (auto &subdirectory: indexDirectory(relPath))
+            loadFileTable(subdirectory);
+    }
+
+    std::vector<path> FileSystemProxy::indexDirectory(const std::filesystem::path &relPath) {
+        std::vector<path> subdirectories;
+        {
+            auto lk = std::shared_lock(_directoryMutex);
+            if (auto known = _directoryIndex.find(relPath); known != _directoryIndex.end()) {
+                for (const auto &[name, modified]: known->second._directories)
+                    subdirectories.push_back(relPath / name);
+                return subdirectories;
+            }
+        }
+        FTPDirectoryEntry directory;
+        if (!adoptPersisted(relPath, directory)) {
+            //Stamped before reading, so that a change made meanwhile makes the next run read the directory again.
+            directory._stamp = directoryStamp(_root / relPath);
+            directory._modified = lastWriteTime(_root / relPath);
+            for (auto &item: directory_iterator(_root / relPath)) {
+                if (item.is_directory() && item.path().filename() != ".tmp")
+                    directory._directories.emplace(item.path().filename(), lastWriteTime(item.path()));
+                else if (item.is_regular_file()) {
+                    directory._files.insert(item.path().filename());
+                    updateFileTable(relPath / item.path().filename());
+                }
+            }
+        }
+        for (const auto &[name, modified]: directory._directories)
+            subdirectories.push_back(relPath / name);
+        addDirectory(relPath, std::move(directory));
+        return subdirectories;
+    }
 
-        for (auto &item: directory_iterator(_root / relPath)) {
-            if (item.is_directory() && item.path().filename() != ".tmp")
-                loadFileTable(relPath / item.path().filename());
-            else if (item.is_regular_file())
-                updateFileTable(relPath / item.path().filename());
+    void FileSystemProxy::addDirectory(const std::filesystem::path &relPath, FTPDirectoryEntry &&directory) {
+        std::size_t files = directory._files.size();
+        auto lk = std::unique_lock(_directoryMutex);
+        //Indexed twice if touched by a connection while the background walk is on it, only the first one counts.
+        if (_directoryIndex.try_emplace(relPath, std::move(directory)).second) {
+            _indexedDirectories.fetch_add(1, std::memory_order_relaxed);
+            _indexedFiles.fetch_add(files, std::memory_order_relaxed);
         }
     }
 
-    void FileSystemProxy::updateFileTable(const std::filesystem::path &relativePath) {
-        assert(relativePath.has_filename());
-        assert(!relativePath.has_root_path());
-        auto lk = std::lock_guard(_filesystemMutex);
+    bool FileSystemProxy::adoptPersisted(const std::filesystem::path &relPath, FTPDirectoryEntry &directory) {
+        if (!_persistedIndex)
+            return false;
+        const auto *record = _persistedIndex->find(relPath.string());
+        if (!record || !record->stamp || record->stamp != directoryStamp(_root / relPath))
+            return false;
+        directory._stamp = record->stamp;
+        directory._modified = record->modified;
+        for (const auto &subdirectory: _persistedIndex->subdirectories(*record))
+            directory._directories.emplace(_persistedIndex->string(subdirectory.name), subdirectory.modified);
+        for (const auto &file: _persistedIndex->files(*record)) {
+            std::string name(_persistedIndex->string(file.name));
+            HashedPath key = relPath / name;
+            FileVersions versions;
+            for (const auto &version: _persistedIndex->versions(file)) {
+                auto fileEntryPtr = std::make_shared<FTPFileEntry>();
+                fileEntryPtr->_keyPath = key;
+                fileEntryPtr->_truePath = _root / _persistedIndex->string(version.truePath);
+                fileEntryPtr->_size = version.size;
+                fileEntryPtr->_modified = version.modified;
+                versions.push_back(std::move(fileEntryPtr));
+            }
+            auto &shard = shardOf(key);
+            {
+                auto lk = std::unique_lock(shard._mutex);
+                shard._fileTable.try_emplace(key, std::move(versions));
+            }
+            directory._files.insert(std::move(name));
+        }
+        return true;
+    }
+
+    void FileSystemProxy::loadPersistedIndex() {
+        _persistedIndex = MetadataIndex::open(persistedIndexPath());
+        if (_persistedIndex)
+            unlink(persistedIndexPath().c_str());
+    }
+
+    void FileSystemProxy::persistIndex(const std::set<path> &changedDirectories) {
+        //The parents list the mtimes of the changed directories too.
+        std::set<path> stale = changedDirectories;
+        for (const auto &directory: changedDirectories)
+            if (!directory.empty())
+                stale.insert(directory.parent_path());
+
+        MetadataIndexWriter writer;
+        for (const auto &[relPath, directory]: _directoryIndex) {
+            writer.addDirectory(relPath.string(), stale.contains(relPath) ? 0 : directory._stamp, directory._modified);
+            for (const auto &[name, modified]: directory._directories)
+                writer.addSubdirectory(name, modified);
+            for (const auto &name: directory._files) {
+                HashedPath key = relPath / name;
+                auto &table = shardOf(key)._fileTable;
+                auto versions = table.find(key);
+                if (versions == table.end() || versions->second.empty())
+                    continue;
+                //Only the latest version is left on disk by now.
+                const auto &latest = versions->second.back();
+                writer.addFile(name);
+                writer.addVersion(latest->_truePath.lexically_relative(_root).string(), latest->_size, latest->_modified);
+            }
+        }
+        if (_persistedIndex)
+            //The directories this run has not needed keep the records of the previous one.
+            for (const auto &record: _persistedIndex->directories()) {
+                path relPath = _persistedIndex->string(record.path);
+                if (_directoryIndex.contains(relPath))
+                    continue;
+                writer.addDirectory(relPath.string(), stale.contains(relPath) ? 0 : record.stamp, record.modified);
+                for (const auto &subdirectory: _persistedIndex->subdirectories(record))
+                    writer.addSubdirectory(_persistedIndex->string(subdirectory.name), subdirectory.modified);
+                for (const auto &file: _persistedIndex->files(record)) {
+                    writer.addFile(_persistedIndex->string(file.name));
+                    for (const auto &version: _persistedIndex->versions(file))
+                        writer.addVersion(_persistedIndex->string(version.truePath), version.size, version.modified);
+                }
+            }
+        std::error_code ec;
+        create_directories(_root / ".tmp", ec);
+        writer.write(persistedIndexPath());
+    }
+
+    bool FileSystemProxy::ensureIndexed(const std::filesystem::path &relPath) {
+        {
+            auto lk = std::shared_lock(_directoryMutex);
+            if (_directoryIndex.contains(relPath))
+                return true;
+        }
+        if (!mayBeUnindexed(relPath))
+            return false;
+        std::error_code ec;
+        if (!is_directory(_root / relPath, ec))
+            return false;
+        auto subdirectories = indexDirectory(relPath);
+        auto lk = std::lock_guard(_queueMutex);
+        //The walk has not got past a failed directory, so its subdirectories are left to the first touch as well.
+        if (_unindexedSubtrees.erase(relPath))
+            _unindexedSubtrees.insert(subdirectories.begin(), subdirectories.end());
+        return true;
+    }
+
+    bool FileSystemProxy::mayBeUnindexed(const std::filesystem::path &relPath) {
+        if (!_indexingDone.load(std::memory_order_acquire))
+            return true;
+        auto lk = std::lock_guard(_queueMutex);
+        return std::any_of(_unindexedSubtrees.begin(), _unindexedSubtrees.end(), [&relPath](const path &subtree) {
+            return std::mismatch(subtree.begin(), subtree.end(), relPath.begin(), relPath.end()).first == subtree.end();
+        });
+    }
+
+    void FileSystemProxy::startIndexing() {
+        //Picked up by the workers as soon as they start.
+        _pendingDirectories.emplace_back();
+        _unfinishedDirectories = 1;
+    }
+
+    void FileSystemProxy::post(std::function<void()> &&job) {
+        {
+            auto lk = std::lock_guard(_queueMutex);
+            _jobs.push_back(std::move(job));
+        }
+        _queueChanged.notify_one();
+    }
+
+    void FileSystemProxy::workQueued(const std::stop_token &stop) {
+        while (true) {
+            std::function<void()> job;
+            path directory;
+            {
+                auto lk = std::unique_lock(_queueMutex);
+                _queueChanged.wait(lk, stop, [this] { return !_jobs.empty() || !_pendingDirectories.empty(); });
+                if (stop.stop_requested())
+                    return;
+                if (!_jobs.empty()) {
+                    //A connection waits for each of the lookups, while nobody waits for the walk.
+                    job = std::move(_jobs.front());
+                    _jobs.pop_front();
+                } else {
+                    directory = std::move(_pendingDirectories.back());
+                    _pendingDirectories.pop_back();
+                }
+            }
+            if (job)
+                job();
+            else
+                indexQueued(std::move(directory));
+        }
+    }
+
+    void FileSystemProxy::indexQueued(std::filesystem::path &&directory) {
+        std::vector<path> subdirectories;
+        bool failed = false;
+        try {
+            subdirectories = indexDirectory(directory);
+        } catch (const filesystem_error &) {
+            //The subtree is left to the on-demand indexing.
+            failed = true;
+        }
+        {
+            auto lk = std::lock_guard(_queueMutex);
+            if (failed)
+                _unindexedSubtrees.insert(std::move(directory));
+            _unfinishedDirectories += subdirectories.size();
+            std::move(subdirectories.begin(), subdirectories.end(), std::back_inserter(_pendingDirectories));
+            if (--_unfinishedDirectories == 0)
+                _indexingDone.store(true, std::memory_order_release);
+        }
+        _queueChanged.notify_all();
+    }
+
+    void FileSystemProxy::facts(const std::shared_ptr<AsyncUring> &ring, const std::filesystem::path &relativePath,
+                                FactsCallback &&cb) {
+        if (auto known = knownFacts(relativePath); known || !mayBeUnindexed(relativePath)) {
+            cb(std::move(known));
+            return;
+        }
+        post([this, ring, relativePath, cb = std::move(cb)]() mutable {
+            std::optional<Facts> found;
+            try {
+                found = lookupFacts(relativePath);
+            } catch (const std::exception &) {
+                //An unreadable path is reported as an unknown one.
+            }
+            ring->async_nop([cb = std::move(cb), found = std::move(found)](std::int64_t) mutable {
+                cb(std::move(found));
+            });
+        });
+    }
+
+    void FileSystemProxy::directoryFacts(const std::shared_ptr<AsyncUring> &ring,
+                                         const std::filesystem::path &relativePath, DirectoryFactsCallback &&cb) {
+        bool indexed;
+        {
+            auto lk = std::shared_lock(_directoryMutex);
+            indexed = _directoryIndex.contains(relativePath);
+        }
+        if (indexed || !mayBeUnindexed(relativePath)) {
+            //Answered from the table alone.
+            cb(lookupDirectoryFacts(relativePath));
+            return;
+        }
+        post([this, ring, relativePath, cb = std::move(cb)]() mutable {
+            std::optional<std::vector<Facts>> found;
+            try {
+                found = lookupDirectoryFacts(relativePath);
+            } catch (const std::exception &) {
+                //An unreadable directory is reported as an unknown one.
+            }
+            ring->async_nop([cb = std::move(cb), found = std::move(found)](std::int64_t) mutable {
+                cb(std::move(found));
+            });
+        });
+    }
+
+    std::optional<FileSystemProxy::Facts> FileSystemProxy::knownFacts(const std::filesystem::path &relativePath) {
+        {
+            auto lk = std::shared_lock(_directoryMutex);
+            if (auto directory = _directoryIndex.find(relativePath); directory != _directoryIndex.end())
+                return Facts{relativePath.filename(), true, 0, directory->second._modified};
+        }
+        if (!relativePath.has_filename())
+            return std::nullopt;
+        HashedPath key = relativePath;
+        auto &shard = shardOf(key);
+        auto lk = std::shared_lock(shard._mutex);
+        if (auto found = shard._fileTable.find(key); found != shard._fileTable.end() && !found->second.empty())
+            return Facts{relativePath.filename(), false, found->second.back()->_size, found->second.back()->_modified};
+        return std::nullopt;
+    }
+
+    std::optional<FileSystemProxy::Facts> FileSystemProxy::lookupFacts(const std::filesystem::path &relativePath) {
+        if (ensureIndexed(relativePath)) {
+            auto lk = std::shared_lock(_directoryMutex);
+            if (auto directory = _directoryIndex.find(relativePath); directory != _directoryIndex.end())
+                return Facts{relativePath.filename(), true, 0, directory->second._modified};
+        }
+        if (!relativePath.has_filename())
+            return std::nullopt;
+        HashedPath key = relativePath;
+        auto &shard = shardOf(key);
+        FileVersions versions;
+        {
+            auto lk = std::shared_lock(shard._mutex);
+            if (auto found = shard._fileTable.find(key); found != shard._fileTable.end())
+                versions = found->second;
+        }
+        if (versions.empty() && mayBeUnindexed(relativePath))
+            versions = updateFileTable(key);
+        if (versions.empty())
+            return std::nullopt;
+        const auto &file = versions.back();
+        return Facts{relativePath.filename(), false, file->_size, file->_modified};
+    }
+
+    std::optional<std::vector<FileSystemProxy::Facts>>
+    FileSystemProxy::lookupDirectoryFacts(const std::filesystem::path &relativePath) {
+        if (!ensureIndexed(relativePath))
+            return std::nullopt;
+        std::vector<Facts> result;
+        std::set<std::string> files;
+        {
+            auto lk = std::shared_lock(_directoryMutex);
+            auto directory = _directoryIndex.find(relativePath);
+            if (directory == _directoryIndex.end())
+                return std::nullopt;
+            for (const auto &[name, modified]: directory->second._directories)
+                result.push_back({name, true, 0, modified});
+            files = directory->second._files;
+        }
+        for (const auto &name: files) {
+            HashedPath key = relativePath / name;
+            auto &shard = shardOf(key);
+            auto lk = std::shared_lock(shard._mutex);
+            if (auto versions = shard._fileTable.find(key);
+                    versions != shard._fileTable.end() && !versions->second.empty())
+                result.push_back({name, false, versions->second.back()->_size, versions->second.back()->_modified});
+        }
+        return result;
+    }
+
+    FileSystemProxy::FileVersions FileSystemProxy::updateFileTable(const HashedPath &key) {
+        assert(key._path.has_filename());
+        assert(!key._path.has_root_path());
+        auto &shard = shardOf(key);
+        auto lk = std::unique_lock(shard._mutex);
+        if (auto found = shard._fileTable.find(key); found != shard._fileTable.end())
+            //Someone else has read the file from disk in the meantime.
+            return found->second;
+        auto versions = readVersions(shard, key);
+        if (!versions.empty())
+            shard._fileTable.emplace(key, versions);
+        return versions;
+    }
+
+    FileSystemProxy::FileVersions FileSystemProxy::readVersions(const FileShard &shard, const HashedPath &key) {
+        const auto &relativePath = key._path;
         auto originalFilePath = _root / relativePath,
                 tmpFileDir = _root / ".tmp" / relativePath;
 
         if (!is_directory(tmpFileDir) && exists(tmpFileDir))
             throw std::runtime_error("FTP File tree is corrupt");
 
-        std::vector<directory_entry> files = {directory_entry(originalFilePath)};
+        std::vector<directory_entry> files;
+        if (exists(originalFilePath))
+            files.emplace_back(originalFilePath);
         if (exists(tmpFileDir))
             for (auto &tmpFile: directory_iterator(tmpFileDir))
                 files.push_back(tmpFile);
@@ -95,17 +640,26 @@ namespace ftp {
             return lhs.last_write_time() < rhs.last_write_time();
         });
 
+        auto edited = shard._filesBeingEdited.find(key);
+        FileVersions versions;
         for (auto &file: files) {
+            if (edited != shard._filesBeingEdited.end() && edited->second->_truePath == file.path())
+                continue;
+            if (file.path() != originalFilePath && file != files.back()) {
+                remove(file.path().c_str());
+                continue;
+            }
             auto fileEntryPtr = std::make_shared<FTPFileEntry>();
-            fileEntryPtr->_keyPath = relativePath;
+            fileEntryPtr->_keyPath = key;
             fileEntryPtr->_truePath = file.path();
-            if (!_filesBeingEdited.contains(file.path())) {
-                if (file.path() != _root / relativePath && file != files.back())
-                    remove(file.path().c_str());
-                else
-                    _fileTable[relativePath].push_back(fileEntryPtr);
-            }
+            std::error_code ec;
+            if (auto size = file.file_size(ec); !ec)
+                fileEntryPtr->_size = size;
+            if (auto time = file.last_write_time(ec); !ec)
+                fileEntryPtr->_modified = toUnixTime(time);
+            versions.push_back(std::move(fileEntryPtr));
         }
+        return versions;
     }
 
 }
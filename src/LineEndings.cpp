@@ -0,0 +1,119 @@
+#include <LineEndings.h>
+
+#include <cstring>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace ftp {
+
+    namespace {
+        //Returns the offset of the first c in data, or size if there is none.
+        using FindByte = std::size_t (*)(const char* data, std::size_t size, char c);
+
+        std::size_t findScalar(const char* data, std::size_t size, char c) {
+            auto* hit = static_cast<const char*>(std::memchr(data, c, size));
+            return hit ? hit - data : size;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        __attribute__((target("sse2")))
+        std::size_t findSse2(const char* data, std::size_t size, char c) {
+            const __m128i needle = _mm_set1_epi8(c);
+            std::size_t i = 0;
+            for(; i + 16 <= size; i += 16) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                if(auto mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle))))
+                    return i + __builtin_ctz(mask);
+            }
+            return i + findScalar(data + i, size - i, c);
+        }
+
+        __attribute__((target("avx2")))
+        std::size_t findAvx2(const char* data, std::size_t size, char c) {
+            const __m256i needle = _mm256_set1_epi8(c);
+            std::size_t i = 0;
+            for(; i + 32 <= size; i += 32) {
+                __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                if(auto mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle))))
+                    return i + __builtin_ctz(mask);
+            }
+            return i + findSse2(data + i, size - i, c);
+        }
+#endif
+
+        FindByte selectFindByte() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+                return findAvx2;
+            if(__builtin_cpu_supports("sse2"))
+                return findSse2;
+#endif
+            return findScalar;
+        }
+
+        //Picked once for the CPU the server runs on.
+        const FindByte findByte = selectFindByte();
+    }
+
+    void LineEndingEncoder::encode(std::string_view input, std::string& output) {
+        if(input.empty())
+            return;
+        //Sized once for the worst case (every byte an LF) and trimmed at the end.
+        std::size_t start = output.size();
+        output.resize(start + input.size() * 2);
+        char* out = output.data() + start;
+        const char* in = input.data();
+        std::size_t size = input.size(), pos = 0;
+        while(pos < size) {
+            std::size_t run = findByte(in + pos, size - pos, '\n');
+            std::memcpy(out, in + pos, run);
+            out += run;
+            pos += run;
+            if(pos == size)
+                break;
+            if(!(pos > 0 ? in[pos - 1] == '\r' : _previousCR))
+                *out++ = '\r';
+            *out++ = '\n';
+            pos++;
+        }
+        _previousCR = in[size - 1] == '\r';
+        output.resize(out - output.data());
+    }
+
+    void LineEndingDecoder::decode(std::string_view input, std::string& output) {
+        if(input.empty())
+            return;
+        std::size_t start = output.size();
+        output.resize(start + input.size() + 1);
+        char* out = output.data() + start;
+        const char* in = input.data();
+        std::size_t size = input.size(), pos = 0;
+        if(std::exchange(_pendingCR, false) && in[0] != '\n')
+            *out++ = '\r';
+        while(pos < size) {
+            std::size_t run = findByte(in + pos, size - pos, '\r');
+            std::memcpy(out, in + pos, run);
+            out += run;
+            pos += run;
+            if(pos == size)
+                break;
+            if(pos + 1 == size)
+                //Whether it ends a line is up to the next chunk.
+                _pendingCR = true;
+            else if(in[pos + 1] != '\n')
+                *out++ = '\r';
+            //The LF of a pair starts the next run.
+            pos++;
+        }
+        output.resize(out - output.data());
+    }
+
+    void LineEndingDecoder::finish(std::string& output) {
+        if(std::exchange(_pendingCR, false))
+            output.push_back('\r');
+    }
+
+}
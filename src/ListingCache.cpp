@@ -0,0 +1,128 @@
+#include <ListingCache.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace ftp {
+
+    namespace {
+        //Everything that changes what ls -l shows for the entries of a directory.
+        constexpr std::uint32_t watchedEvents = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+                                                IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+        constexpr std::size_t eventBufferSize = 1UL << 14;
+
+        std::string key(const std::filesystem::path& directory) {
+            std::string result = directory.lexically_normal().string();
+            while(!result.empty() && result.back() == '/')
+                result.pop_back();
+            return result == "." ? std::string() : result;
+        }
+
+        std::string parentKey(const std::string& directory) {
+            auto slash = directory.rfind('/');
+            return slash == std::string::npos ? std::string() : directory.substr(0, slash);
+        }
+    }
+
+    ListingCache::ListingCache(std::filesystem::path root):
+            _root(std::move(root)),
+            _inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+            _events(std::make_shared<std::string>()) {
+        if(_inotifyFd < 0)
+            throw std::system_error(errno, std::system_category(), "ListingCache()");
+    }
+
+    void ListingCache::start(const std::shared_ptr<AsyncUring>& ring) {
+        _ring = ring;
+        readEvents();
+    }
+
+    void ListingCache::readEvents() {
+        _events->resize(eventBufferSize);
+        _ring->async_read_some(_inotifyFd, std::shared_ptr<std::string>(_events),
+                               [self = shared_from_this()](std::int64_t res){
+            if(res < 0)
+                //the descriptor is gone
+                return;
+            {
+                auto lk = std::lock_guard(self->_mutex);
+                for(std::int64_t offset = 0; offset < res;) {
+                    auto* event = reinterpret_cast<const inotify_event*>(self->_events->data() + offset);
+                    offset += std::int64_t(sizeof(inotify_event)) + event->len;
+                    if(event->mask & IN_Q_OVERFLOW) {
+                        self->clear();
+                        continue;
+                    }
+                    auto watched = self->_watchedPaths.find(event->wd);
+                    if(watched == self->_watchedPaths.end())
+                        continue;
+                    self->dropListings(watched->second);
+                    if(event->mask & IN_IGNORED) {
+                        //The directory is gone or the watch was removed.
+                        self->_watches.erase(watched->second);
+                        self->_watchedPaths.erase(watched);
+                    }
+                }
+            }
+            self->readEvents();
+        });
+    }
+
+    std::shared_ptr<std::string> ListingCache::find(const std::filesystem::path& directory, bool crlf) {
+        auto lk = std::lock_guard(_mutex);
+        auto cached = _listings.find(key(directory));
+        return cached == _listings.end() ? nullptr : cached->second[crlf];
+    }
+
+    std::uint64_t ListingCache::watch(const std::filesystem::path& directory) {
+        auto lk = std::lock_guard(_mutex);
+        auto name = key(directory);
+        if(!_watches.contains(name)) {
+            int wd = inotify_add_watch(_inotifyFd, (_root / name).c_str(), watchedEvents | IN_ONLYDIR);
+            if(wd < 0)
+                return noGeneration;
+            _watches.emplace(name, wd);
+            _watchedPaths.emplace(wd, name);
+        }
+        return _generation;
+    }
+
+    void ListingCache::store(const std::filesystem::path& directory, bool crlf, std::shared_ptr<std::string> listing,
+                             std::uint64_t generation) {
+        auto lk = std::lock_guard(_mutex);
+        if(generation != _generation)
+            //Something changed while the listing was produced, it may be stale already.
+            return;
+        auto name = key(directory);
+        if(_listings.size() >= maxEntries && !_listings.contains(name))
+            clear();
+        _listings[name][crlf] = std::move(listing);
+    }
+
+    void ListingCache::invalidate(const std::filesystem::path& directory) {
+        auto lk = std::lock_guard(_mutex);
+        dropListings(key(directory));
+    }
+
+    void ListingCache::dropListings(const std::string& directory) {
+        _generation++;
+        _listings.erase(directory);
+        if(!directory.empty())
+            _listings.erase(parentKey(directory));
+    }
+
+    void ListingCache::clear() {
+        _generation++;
+        _listings.clear();
+        for(auto& [wd, name]: _watchedPaths)
+            inotify_rm_watch(_inotifyFd, wd);
+        _watchedPaths.clear();
+        _watches.clear();
+    }
+
+    ListingCache::~ListingCache() {
+        close(_inotifyFd);
+    }
+
+}
@@ -0,0 +1,180 @@
+#include <MetadataIndex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ftp {
+
+    namespace {
+        constexpr char indexMagic[8] = {'F', 'T', 'P', 'I', 'N', 'D', 'E', 'X'};
+        constexpr std::uint32_t indexVersion = 1;
+
+        struct Header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t reserved;
+            std::uint64_t directories;
+            std::uint64_t subdirectories;
+            std::uint64_t files;
+            std::uint64_t versions;
+            std::uint64_t strings;
+        };
+
+        bool writeBytes(int fd, const void* bytes, std::size_t left) {
+            auto* data = static_cast<const char*>(bytes);
+            while(left) {
+                ssize_t written = ::write(fd, data, left);
+                if(written <= 0)
+                    return false;
+                data += written;
+                left -= written;
+            }
+            return true;
+        }
+
+        template<typename Record>
+        bool writeRecords(int fd, const std::vector<Record>& records) {
+            return writeBytes(fd, records.data(), records.size() * sizeof(Record));
+        }
+
+        bool inRange(std::uint64_t first, std::uint64_t count, std::size_t size) {
+            return first <= size && count <= size - first;
+        }
+    }
+
+    std::unique_ptr<MetadataIndex> MetadataIndex::open(const std::filesystem::path& file) {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return nullptr;
+        struct stat fileStat{};
+        if(fstat(fd, &fileStat) || std::size_t(fileStat.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return nullptr;
+        }
+        std::size_t size = fileStat.st_size;
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        //The mapping keeps the pages reachable after the descriptor is gone.
+        ::close(fd);
+        if(mapping == MAP_FAILED)
+            return nullptr;
+        auto index = std::unique_ptr<MetadataIndex>(new MetadataIndex(mapping, size));
+
+        const auto* header = static_cast<const Header*>(mapping);
+        if(std::memcmp(header->magic, indexMagic, sizeof(indexMagic)) || header->version != indexVersion)
+            return nullptr;
+        //Every section is a multiple of 8 bytes long, so the records that follow stay aligned.
+        std::size_t offset = sizeof(Header);
+        auto section = [&]<typename Record>(std::span<const Record>& records, std::uint64_t count) {
+            if(count > (size - offset) / sizeof(Record))
+                return false;
+            records = {reinterpret_cast<const Record*>(static_cast<const char*>(mapping) + offset), count};
+            offset += count * sizeof(Record);
+            return true;
+        };
+        if(!section(index->_directories, header->directories) ||
+           !section(index->_subdirectories, header->subdirectories) ||
+           !section(index->_files, header->files) ||
+           !section(index->_versions, header->versions) ||
+           header->strings != size - offset)
+            return nullptr;
+        index->_strings = {static_cast<const char*>(mapping) + offset, header->strings};
+        return index->valid() ? std::move(index) : nullptr;
+    }
+
+    bool MetadataIndex::valid() const noexcept {
+        auto validString = [this](const StringRef& ref){ return inRange(ref.offset, ref.length, _strings.size()); };
+        for(const auto& directory: _directories)
+            if(!validString(directory.path) ||
+               !inRange(directory.firstSubdirectory, directory.subdirectoryCount, _subdirectories.size()) ||
+               !inRange(directory.firstFile, directory.fileCount, _files.size()))
+                return false;
+        for(const auto& subdirectory: _subdirectories)
+            if(!validString(subdirectory.name))
+                return false;
+        for(const auto& file: _files)
+            if(!validString(file.name) || !inRange(file.firstVersion, file.versionCount, _versions.size()))
+                return false;
+        for(const auto& version: _versions)
+            if(!validString(version.truePath))
+                return false;
+        return std::is_sorted(_directories.begin(), _directories.end(), [this](const auto& lhs, const auto& rhs){
+            return string(lhs.path) < string(rhs.path);
+        });
+    }
+
+    const MetadataIndex::DirectoryRecord* MetadataIndex::find(std::string_view directory) const {
+        auto found = std::lower_bound(_directories.begin(), _directories.end(), directory,
+                                      [this](const DirectoryRecord& record, std::string_view path){
+            return string(record.path) < path;
+        });
+        return found != _directories.end() && string(found->path) == directory ? &*found : nullptr;
+    }
+
+    MetadataIndex::~MetadataIndex() {
+        munmap(_mapping, _size);
+    }
+
+    MetadataIndex::StringRef MetadataIndexWriter::addString(std::string_view string) {
+        MetadataIndex::StringRef ref{_strings.size(), std::uint32_t(string.size()), 0};
+        _strings += string;
+        return ref;
+    }
+
+    void MetadataIndexWriter::addDirectory(std::string_view path, std::int64_t stamp, std::int64_t modified) {
+        _directories.push_back({addString(path), stamp, modified, _subdirectories.size(), 0, _files.size(), 0});
+    }
+
+    void MetadataIndexWriter::addSubdirectory(std::string_view name, std::int64_t modified) {
+        _subdirectories.push_back({addString(name), modified});
+        _directories.back().subdirectoryCount++;
+    }
+
+    void MetadataIndexWriter::addFile(std::string_view name) {
+        _files.push_back({addString(name), _versions.size(), 0});
+        _directories.back().fileCount++;
+    }
+
+    void MetadataIndexWriter::addVersion(std::string_view truePath, std::uint64_t size, std::int64_t modified) {
+        _versions.push_back({addString(truePath), size, modified});
+        _files.back().versionCount++;
+    }
+
+    bool MetadataIndexWriter::write(const std::filesystem::path& file) {
+        //The directories are looked up by a binary search over their paths.
+        std::sort(_directories.begin(), _directories.end(), [this](const auto& lhs, const auto& rhs){
+            return std::string_view(_strings).substr(lhs.path.offset, lhs.path.length) <
+                   std::string_view(_strings).substr(rhs.path.offset, rhs.path.length);
+        });
+        _strings.resize((_strings.size() + 7) / 8 * 8, '\0');
+        Header header{};
+        std::memcpy(header.magic, indexMagic, sizeof(indexMagic));
+        header.version = indexVersion;
+        header.directories = _directories.size();
+        header.subdirectories = _subdirectories.size();
+        header.files = _files.size();
+        header.versions = _versions.size();
+        header.strings = _strings.size();
+
+        auto temporary = file;
+        temporary += ".new";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0)
+            return false;
+        bool written = writeBytes(fd, &header, sizeof(header)) &&
+                       writeRecords(fd, _directories) && writeRecords(fd, _subdirectories) &&
+                       writeRecords(fd, _files) && writeRecords(fd, _versions) &&
+                       writeBytes(fd, _strings.data(), _strings.size()) &&
+                       fsync(fd) == 0;
+        ::close(fd);
+        if(!written || ::rename(temporary.c_str(), file.c_str())) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+}
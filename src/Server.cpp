@@ -3,3 +3,198 @@
 //
 
 #include <Server.h>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+namespace ftp {
+
+    Server::Server(sockaddr_in localAddress, const std::filesystem::path &ftpRootPath, ServerOptions options):
+            ConnectionBase(-1,
+                           localAddress,
+                           makeRing(options, 0)
+            ),
+            _threadPool(std::max(options.threads, 1U)),
+            _ftpRoot(ftpRootPath),
+            _fileSystem(std::make_shared<FileSystemProxy>(ftpRootPath, options.indexing, options.indexingThreads)),
+            _options(options),
+            _running(true)
+    {
+        if(!std::filesystem::exists(ftpRootPath))
+            throw std::runtime_error("Specified path does not exist");
+        _rings.push_back(_ring);
+        if(_options.sharded)
+            for(unsigned i = 1; i < std::max(_options.threads, 1U); i++)
+                _rings.push_back(makeRing(_options, i));
+        //Every ring is made alike, so they all get the same of what the kernel supports.
+        std::cout << "Event loop rings: " << _ring->setup_description() << '\n';
+        registerBufferPools();
+        if(_options.directIoThreshold)
+            startFileRings();
+        try {
+            _listingCache = std::make_shared<ListingCache>(ftpRootPath);
+            _listingCache->start(_ring);
+            //A committed STOR changes the listing of its directory.
+            _fileSystem->setCommitHook([cache = _listingCache](const std::filesystem::path& file){
+                cache->invalidate(file.parent_path());
+            });
+        } catch(const std::system_error& e) {
+            _listingCache.reset();
+            std::cerr << "Directory listings are not cached: " << e.what() << '\n';
+        }
+        if(_options.fixedFiles)
+            for(auto& ring: _rings)
+                if(!ring->enable_fixed_files(_options.fixedFiles)) {
+                    std::cerr << "Could not register the fixed file table, descriptors are posted as is\n";
+                    break;
+                }
+        for(auto& ring: _rings)
+            if(!ring->register_provided_buffers(_options.controlBufferCount, _options.controlBufferSize)) {
+                std::cerr << "Provided buffer rings are unavailable, control connections fall back to their own buffers\n";
+                break;
+            }
+
+        if(!_options.sharded) {
+            _threadPool.executor().post([this](){
+                pinEventLoop(0);
+                //Each turn pushes everything queued by the callbacks in one io_uring_enter and sleeps in the kernel
+                //until there is something to reap.
+                while(_running)
+                    _ring->wait_act(completionWaitTimeout, [this](Completion&& completion){
+                        _threadPool.executor().post(std::move(completion), std::allocator<void>());
+                    });
+            }, std::allocator<void>());
+            return;
+        }
+        //Thread-per-core: every pool thread runs the loop of its own ring and executes the callbacks inline,
+        //so a connection never leaves the shard that accepted it.
+        for(std::size_t i = 0; i < _rings.size(); i++)
+            _threadPool.executor().post([this, i, ring = _rings[i]](){
+                pinEventLoop(i);
+                while(_running)
+                    ring->wait_act(completionWaitTimeout, [](Completion&& completion){
+                        completion();
+                    });
+            }, std::allocator<void>());
+    }
+
+    std::shared_ptr<AsyncUring> Server::makeRing(const ServerOptions& options, std::size_t shard) {
+        SqThread sqThread{.idle = options.sqThreadIdle};
+        if(!options.sqThreadCpus.empty())
+            sqThread.cpu = options.sqThreadCpus[shard % options.sqThreadCpus.size()];
+        //A shallow ring can not hold a whole batch.
+        return std::make_shared<AsyncUring>(int(options.ringDepth), options.ringMode, std::min(submitBatch, options.ringDepth),
+                                            AsyncUring::defaultSubmitBytes, sqThread,
+                                            //Only a shard has a single thread waiting on its ring.
+                                            options.sharded);
+    }
+
+    void Server::pinEventLoop(std::size_t shard) const {
+        if(_options.completionCpus.empty())
+            return;
+        int cpu = _options.completionCpus[shard % _options.completionCpus.size()];
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        //The loop keeps its pool thread for good, so the thread stays bound as long as the server runs.
+        if(int res = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+            std::cerr << "Could not bind the event loop " << shard << " to CPU " << cpu << ": "
+                      << std::system_category().message(res) << '\n';
+    }
+
+    void Server::registerBufferPools() {
+        //Registered buffers belong to a single ring, so the budget is split between the shards.
+        std::size_t buffersPerRing = _options.bufferPoolBudget / _options.transferBufferSize / _rings.size();
+        if(buffersPerRing == 0)
+            return;
+        for(auto& ring: _rings)
+            if(!ring->register_buffer_pool(BufferPool::create(buffersPerRing, _options.transferBufferSize))) {
+                std::cerr << "Could not register the transfer buffers, data connections fall back to heap buffers\n";
+                return;
+            }
+    }
+
+    void Server::startFileRings() {
+        //O_DIRECT wants aligned buffers, which only the pool provides.
+        if(!_ring->buffer_pool()) {
+            std::cerr << "The large-file mode needs the registered transfer buffers, large files are read buffered\n";
+            return;
+        }
+        std::vector<std::shared_ptr<AsyncUring>> fileRings;
+        try {
+            for(auto& ring: _rings) {
+                auto fileRing = std::make_shared<AsyncUring>(int(_options.directIoDepth), AsyncUring::UringMode::io_polled);
+                if(!fileRing->register_buffer_pool(ring->buffer_pool()))
+                    throw std::system_error(ENOMEM, std::system_category(), "register_buffer_pool()");
+                fileRings.push_back(std::move(fileRing));
+            }
+        } catch(const std::system_error& e) {
+            std::cerr << "IOPOLL rings are unavailable, large files are read buffered: " << e.what() << '\n';
+            return;
+        }
+        for(std::size_t i = 0; i < _rings.size(); i++) {
+            _rings[i]->attach_file_ring(fileRings[i]);
+            //The completions only post the socket writes, so they run right on the polling thread.
+            _filePollers.emplace_back([this, fileRing = fileRings[i]](const std::stop_token& stop){
+                while(_running && !stop.stop_requested())
+                    fileRing->wait_act(completionWaitTimeout, [](Completion&& completion){
+                        completion();
+                    });
+            });
+        }
+    }
+
+    void Server::start() {
+        std::vector<std::shared_ptr<ConnectionBase>> listeners;
+        for(auto ring: _rings)
+            listeners.push_back(std::make_shared<Listener>(this, std::move(ring), _ftpRoot, _fileSystem, _options.sharded,
+                                                           _options.readAhead, _options.directIoThreshold, _listingCache));
+        {
+            auto lk = std::lock_guard(_childConnectionsMutex);
+            _childConnections.insert(_childConnections.end(), listeners.begin(), listeners.end());
+        }
+        for(auto& listener: listeners)
+            listener->start();
+    }
+
+    void Listener::start() {
+        do {
+            _fd = socket(AF_INET, SOCK_STREAM, 0);
+        } while (_fd == -1);
+        if(_reusePort) {
+            //Every shard binds the same address, the kernel spreads the incoming connections between them.
+            int enable = 1;
+            if (setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)))
+                throw std::system_error(errno, std::system_category());
+        }
+        if (bind(_fd, reinterpret_cast<sockaddr *>(&_localAddr), sizeof(_localAddr)))
+            throw std::system_error(errno, std::system_category());
+        listen(_fd, 20);
+        _ring->register_file(_fd);
+        if(_ring->supports_multishot_accept())
+            //A single armed SQE serves every client, the connection object is built only once a client lands.
+            _ring->async_sock_accept_multishot(_fd, [this](std::int64_t res){
+                if(res >= 0)
+                    adoptConnection(res, makeControlConnection());
+            });
+        else
+            enqueueConnection(_fd, makeControlConnection());
+    }
+
+    void Listener::childAccepted([[maybe_unused]] ConnectionBase *child) {
+        //One-shot accepts: post the next one as soon as the previous client has landed.
+        enqueueConnection(_fd, makeControlConnection());
+    }
+
+    std::shared_ptr<ControlConnection> Listener::makeControlConnection() {
+        return std::make_shared<ControlConnection>(
+                this,
+                std::move(_ftpRoot),
+                std::move(_fileSystem),
+                _readAhead,
+                _directIoThreshold,
+                _listingCache
+        );
+    }
+
+}
@@ -1,21 +1,74 @@
 #include <iostream>
+#include <fstream>
 #include <Server.h>
 #include <boost/program_options.hpp>
 
+//Parses a comma-separated list of CPU numbers, e.g. "0,2,4". Empty stays empty.
+static bool parseCpuList(const std::string& list, std::vector<int>& cpus) {
+    std::stringstream stream(list);
+    std::string cpu;
+    while(std::getline(stream, cpu, ',')) {
+        try {
+            std::size_t parsed;
+            cpus.push_back(std::stoi(cpu, &parsed));
+            if(parsed != cpu.size() || cpus.back() < 0)
+                return false;
+        } catch(const std::logic_error&) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
 
     std::uint16_t port = -1;
     unsigned threadCount = -1;
+    bool sharded = false;
+    std::string ringMode;
+    unsigned ringDepth = 1U << 12;
+    std::string sqThreadCpus;
+    unsigned sqThreadIdle = 0;
+    std::string completionCpus;
+    std::string configFile;
+    unsigned fixedFiles = 0;
+    unsigned readAhead = 4;
+    std::uint64_t directIoThreshold = 0;
+    unsigned directIoDepth = 256;
+    std::string indexing;
+    unsigned indexingThreads = -1;
 
     boost::program_options::options_description desc("Allowed options");
     desc.add_options()
             ("help", "print this help message")
+            ("config", boost::program_options::value<std::string>(&configFile), "read the options from this file as well, one name=value per line; the command line takes precedence")
             ("threads", boost::program_options::value<unsigned>(&threadCount)->default_value(std::thread::hardware_concurrency()), "set the maximum cores to be used")
-            ("port", boost::program_options::value<std::uint16_t>(&port), "set the port for the control connections");
+            ("port", boost::program_options::value<std::uint16_t>(&port), "set the port for the control connections")
+            ("sharded", boost::program_options::bool_switch(&sharded), "run a separate ring and SO_REUSEPORT listener on every thread")
+            ("ring-mode", boost::program_options::value<std::string>(&ringMode)->default_value("interrupted"), "submit with a system call (interrupted) or through a kernel polling thread per ring (sqpoll)")
+            ("ring-depth", boost::program_options::value<unsigned>(&ringDepth)->default_value(1U << 12), "SQ depth of the event loop rings, a power of two up to 4096")
+            ("sq-thread-cpus", boost::program_options::value<std::string>(&sqThreadCpus), "comma-separated CPUs to bind the SQ polling threads to, one per ring in turn")
+            ("sq-thread-idle", boost::program_options::value<unsigned>(&sqThreadIdle)->default_value(0), "milliseconds an idle SQ polling thread spins before it sleeps (0 for the kernel default)")
+            ("completion-cpus", boost::program_options::value<std::string>(&completionCpus), "comma-separated CPUs to bind the event loop threads to, one per ring in turn")
+            ("fixed-files", boost::program_options::value<unsigned>(&fixedFiles)->default_value(0), "register up to this many sockets and files with every ring (0 to disable)")
+            ("read-ahead", boost::program_options::value<unsigned>(&readAhead)->default_value(4), "file chunks read ahead of the socket by a download (1 to disable)")
+            ("direct-io-threshold", boost::program_options::value<std::uint64_t>(&directIoThreshold)->default_value(0), "read the downloads of files from this size on with O_DIRECT on an IOPOLL ring (0 to disable)")
+            ("direct-io-depth", boost::program_options::value<unsigned>(&directIoDepth)->default_value(256), "SQ depth of the IOPOLL rings, a power of two up to 4096")
+            ("indexing", boost::program_options::value<std::string>(&indexing)->default_value("eager"), "fill the file table before starting (eager), on the first touch of a directory (lazy) or in the background (parallel)")
+            ("indexing-threads", boost::program_options::value<unsigned>(&indexingThreads)->default_value(std::thread::hardware_concurrency()), "threads looking up the files not indexed yet and walking the tree in the parallel indexing mode");
 
     boost::program_options::variables_map options;
 
     boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
+    //Values stored first win, so the file only fills in what the command line has left out.
+    if(options.count("config")) {
+        std::ifstream config(options["config"].as<std::string>());
+        if(!config) {
+            std::cerr << "Could not open the config file " << options["config"].as<std::string>() << '\n';
+            return 1;
+        }
+        boost::program_options::store(boost::program_options::parse_config_file(config, desc), options);
+    }
     boost::program_options::notify(options);
 
     if(options.count("help")){
@@ -23,14 +76,55 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    std::cout << "port: " << port << "\nthreads: " << threadCount << '\n';
+    ftp::FileSystemProxy::IndexingMode indexingMode;
+    if(indexing == "eager")
+        indexingMode = ftp::FileSystemProxy::IndexingMode::eager;
+    else if(indexing == "lazy")
+        indexingMode = ftp::FileSystemProxy::IndexingMode::lazy;
+    else if(indexing == "parallel")
+        indexingMode = ftp::FileSystemProxy::IndexingMode::parallel;
+    else {
+        std::cerr << "Unknown indexing mode: " << indexing << '\n';
+        return 1;
+    }
+
+    ftp::AsyncUring::UringMode uringMode;
+    if(ringMode == "interrupted")
+        uringMode = ftp::AsyncUring::UringMode::interrupted;
+    else if(ringMode == "sqpoll")
+        uringMode = ftp::AsyncUring::UringMode::sq_polled;
+    else {
+        //IOPOLL only serves O_DIRECT files, the sockets need one of the above (see --direct-io-threshold).
+        std::cerr << "Unknown ring mode: " << ringMode << '\n';
+        return 1;
+    }
+    if(ringDepth == 0 || ringDepth > 1U << 12 || (ringDepth & (ringDepth - 1))) {
+        std::cerr << "The ring depth has to be a power of two up to 4096\n";
+        return 1;
+    }
+    if(directIoDepth == 0 || directIoDepth > 1U << 12 || (directIoDepth & (directIoDepth - 1))) {
+        std::cerr << "The direct I/O ring depth has to be a power of two up to 4096\n";
+        return 1;
+    }
+    std::vector<int> sqCpus, loopCpus;
+    if(!parseCpuList(sqThreadCpus, sqCpus) || !parseCpuList(completionCpus, loopCpus)) {
+        std::cerr << "CPU lists are comma-separated CPU numbers\n";
+        return 1;
+    }
+
+    std::cout << "port: " << port << "\nthreads: " << threadCount << (sharded ? " (sharded)" : "") << '\n';
 
     signal(SIGPIPE, SIG_IGN);
     sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_port = htons(port);
     address.sin_addr.s_addr = inet_addr("192.168.178.36");
-    static auto controller = ftp::Server(address, std::filesystem::current_path(), threadCount);
+    static auto controller = ftp::Server(address, std::filesystem::current_path(), {.threads = threadCount, .sharded = sharded,
+                                                                                                  .ringMode = uringMode, .ringDepth = ringDepth,
+                                                                                                  .sqThreadCpus = sqCpus, .sqThreadIdle = std::chrono::milliseconds(sqThreadIdle),
+                                                                                                  .completionCpus = loopCpus, .fixedFiles = fixedFiles, .readAhead = readAhead,
+                                                                                                  .directIoThreshold = directIoThreshold, .directIoDepth = directIoDepth,
+                                                                                                  .indexing = indexingMode, .indexingThreads = indexingThreads});
 
     try {
         controller.start();
@@ -39,6 +133,20 @@ int main(int argc, char* argv[]) {
         controller.stop();
         return 1;
     }
+    //The table is filled while the clients are served, tell how far it has got.
+    std::jthread progressReporter;
+    if(indexingMode != ftp::FileSystemProxy::IndexingMode::eager)
+        progressReporter = std::jthread([](const std::stop_token& stop){
+            ftp::FileSystemProxy::IndexingProgress reported;
+            while(!stop.stop_requested() && !reported.done) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                auto progress = controller.fileSystem()->indexingProgress();
+                if(progress.directories != reported.directories || progress.done)
+                    std::cout << "indexed " << progress.directories << " directories, " << progress.files << " files"
+                              << (progress.done ? " (done)" : "") << '\n';
+                reported = progress;
+            }
+        });
     char c;
     std::cin >> c;
     controller.stop();